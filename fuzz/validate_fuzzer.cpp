@@ -0,0 +1,78 @@
+//
+//  validate_fuzzer.cpp
+//  hlmv
+//
+//  libFuzzer target for the model validator. Every input it accepts is
+//  loaded like a model from disk, meshes, skins and sequences included,
+//  so AddressSanitizer catches any offset that was let through unchecked.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Animation.h"
+#include "GoldSrcModel.h"
+#include "SequenceCache.h"
+
+// Frames times bones of one sequence. Constant channels let a small file
+// declare any number of frames, which costs memory but reads nothing.
+#define MAX_DECODED_POSES (1 << 20)
+
+// Bytes of input per second, printed when the fuzzer exits
+static struct Throughput
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t inputs = 0;
+    uint64_t bytes = 0;
+
+    ~Throughput()
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (seconds > 0) {
+            printf("%llu inputs, %.0f bytes/s\n", (unsigned long long)inputs, bytes / seconds);
+        }
+    }
+} throughput;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    throughput.inputs++;
+    throughput.bytes += size;
+
+    ModelLoadOptions options;
+    options.verbose = false;
+
+    // Validates the input, then reads the meshes and skins
+    Model model;
+    if (!model.loadFromMemory({ data, size }, options)) return 0;
+
+    const studiohdr_t* pheader = (const studiohdr_t *)data;
+    const mstudioseqdesc_t* psequences = (const mstudioseqdesc_t *)(data + pheader->seqindex);
+
+    for (int i = 0; i < pheader->numseq; ++i)
+    {
+        const mstudioseqdesc_t& sequence = psequences[i];
+
+        // Other groups are in files a model from memory doesn't have
+        if (sequence.seqgroup != 0) continue;
+        if ((long long)sequence.numframes * pheader->numbones > MAX_DECODED_POSES) continue;
+
+        model.sequenceCache->get(i, true);
+
+        // The loader expands frames, the compressed spans are decoded here
+        Sequence compressed;
+        decodeSequence(data, data, i, compressed, true);
+
+        std::vector<float> values((size_t)pheader->numbones * ANIM_CHANNELS);
+
+        sampleAnimation(compressed.animation, 0, values.data());
+        sampleAnimation(compressed.animation, sequence.numframes - 1, values.data());
+    }
+
+    return 0;
+}
@@ -0,0 +1,238 @@
+//
+//  Animation.cpp
+//  hlmv
+//
+
+#include "Animation.h"
+#include <algorithm>
+#include <bit>
+#include <math.h>
+
+void decodeAnimChannel(const mstudioanimvalue_t* pvalues, int numframes, float base, float scale, float* out, size_t stride)
+{
+    if (pvalues == nullptr)
+    {
+        for (int frame = 0; frame < numframes; ++frame) {
+            out[frame * stride] = base;
+        }
+
+        return;
+    }
+
+    // Each span holds `valid` values for its first frames and repeats the
+    // last one until `total` frames are covered
+    const mstudioanimvalue_t* span = pvalues;
+    int spanStart = 0;
+
+    for (int frame = 0; frame < numframes; ++frame)
+    {
+        while (span->num.total <= frame - spanStart)
+        {
+            spanStart += span->num.total;
+            span += span->num.valid + 1;
+        }
+
+        int k = frame - spanStart;
+        short value = span->num.valid > k ? span[k + 1].value : span[span->num.valid].value;
+
+        out[frame * stride] = base + value * scale;
+    }
+}
+
+void decodeAnimation(const mstudiobone_t* pbones, const mstudioanim_t* panims, int numbones, int numframes, float* values)
+{
+    size_t stride = (size_t)numbones * ANIM_CHANNELS;
+
+    for (int i = 0; i < numbones; ++i)
+    {
+        const mstudiobone_t& bone = pbones[i];
+        const mstudioanim_t& anim = panims[i];
+
+        for (int j = 0; j < ANIM_CHANNELS; ++j)
+        {
+            const mstudioanimvalue_t* pvalues = nullptr;
+
+            if (anim.offset[j] != 0) {
+                pvalues = (const mstudioanimvalue_t *)((const byte *)&anim + anim.offset[j]);
+            }
+
+            decodeAnimChannel(pvalues, numframes, bone.value[j], bone.scale[j], values + i * ANIM_CHANNELS + j, stride);
+        }
+    }
+}
+
+// GCC stops vectorizing sinCos once it is inlined into the block loop
+#if defined(__GNUC__) || defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE
+#endif
+
+// Rotations per block, every axis of a block goes through one loop
+static const int SINCOS_BLOCK = 16;
+
+// pi/2 split into parts that multiply exactly with small quadrant counts (Cody-Waite)
+static const float PIO2_1 = 1.5703125f;
+static const float PIO2_2 = 4.837512969970703125e-4f;
+static const float PIO2_3 = 7.54978995489188216e-8f;
+
+// Minimax polynomials on [-pi/4, pi/4], as in Cephes sinf and cosf
+static const float SIN_1 = -1.6666654611e-1f;
+static const float SIN_2 = 8.3321608736e-3f;
+static const float SIN_3 = -1.9515295891e-4f;
+static const float COS_1 = 4.166664568298827e-2f;
+static const float COS_2 = -1.388731625493765e-3f;
+static const float COS_3 = 2.443315711809948e-5f;
+
+// No branches or calls, every iteration is the same lane of vector code.
+// Takes half angles, returns false if one was too large to reduce accurately.
+NOINLINE static bool sinCos(const float* x, int count, float* s, float* c)
+{
+    int outOfRange = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        // Angles come from the file unchecked. Huge, infinite and NaN ones
+        // are zeroed by a mask, so the conversion to int below stays defined.
+        // Their lanes are out of range and recomputed by the caller anyway.
+        int inRange = fabsf(x[i]) <= SINCOS_MAX_ANGLE * 0.5f;
+        float v = std::bit_cast<float>(std::bit_cast<uint32_t>(x[i]) & (0u - (uint32_t)inRange));
+
+        // Nearest quadrant, the remainder is within [-pi/4, pi/4]
+        int q = (int)(v * 0.63661977236f + copysignf(0.5f, v));
+        float fq = (float)q;
+        float r = ((v - fq * PIO2_1) - fq * PIO2_2) - fq * PIO2_3;
+        float r2 = r * r;
+
+        float ps = r + r * r2 * (SIN_1 + r2 * (SIN_2 + r2 * SIN_3));
+        float pc = 1.0f - 0.5f * r2 + r2 * r2 * (COS_1 + r2 * (COS_2 + r2 * COS_3));
+
+        // Quadrant fixups as bit operations, branches would keep the loop scalar
+        uint32_t sinBits = std::bit_cast<uint32_t>(ps);
+        uint32_t cosBits = std::bit_cast<uint32_t>(pc);
+        uint32_t swap = (sinBits ^ cosBits) & (0u - (uint32_t)(q & 1));
+
+        s[i] = std::bit_cast<float>((sinBits ^ swap) ^ ((uint32_t)(q & 2) << 30));
+        c[i] = std::bit_cast<float>((cosBits ^ swap) ^ ((uint32_t)((q + 1) & 2) << 30));
+
+        // An integer flag, a float max would keep the loop scalar
+        outOfRange |= !inRange;
+    }
+
+    return outOfRange == 0;
+}
+
+void eulerToQuaternions(const float* angles, size_t stride, size_t count, glm::quat* rotations)
+{
+    const int X = 0;
+    const int Y = SINCOS_BLOCK;
+    const int Z = SINCOS_BLOCK * 2;
+
+    for (size_t start = 0; start < count; start += SINCOS_BLOCK)
+    {
+        size_t n = std::min(count - start, (size_t)SINCOS_BLOCK);
+
+        // Half angles of the block by axis, the tail of the last block is padding
+        float half[SINCOS_BLOCK * 3] = {};
+        float s[SINCOS_BLOCK * 3];
+        float c[SINCOS_BLOCK * 3];
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            const float* angle = angles + (start + i) * stride;
+
+            half[X + i] = angle[0] * 0.5f;
+            half[Y + i] = angle[1] * 0.5f;
+            half[Z + i] = angle[2] * 0.5f;
+        }
+
+        if (!sinCos(half, SINCOS_BLOCK * 3, s, c))
+        {
+            for (int i = 0; i < SINCOS_BLOCK * 3; ++i)
+            {
+                s[i] = sinf(half[i]);
+                c[i] = cosf(half[i]);
+            }
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            float w = c[X + i] * c[Y + i] * c[Z + i] + s[X + i] * s[Y + i] * s[Z + i];
+            float x = s[X + i] * c[Y + i] * c[Z + i] - c[X + i] * s[Y + i] * s[Z + i];
+            float y = c[X + i] * s[Y + i] * c[Z + i] + s[X + i] * c[Y + i] * s[Z + i];
+            float z = c[X + i] * c[Y + i] * s[Z + i] - s[X + i] * s[Y + i] * c[Z + i];
+
+            rotations[start + i] = glm::quat(w, x, y, z);
+        }
+    }
+}
+
+size_t CompressedAnimation::size() const
+{
+    return bases.size() * sizeof(float) + scales.size() * sizeof(float) +
+        firstSpan.size() * sizeof(uint32_t) + spanFrames.size() * sizeof(int) +
+        spanValues.size() * sizeof(uint32_t) + values.size() * sizeof(mstudioanimvalue_t);
+}
+
+void compressAnimation(const mstudiobone_t* pbones, const mstudioanim_t* panims, int numbones, int numframes, CompressedAnimation& animation)
+{
+    animation = {};
+    animation.numBones = numbones;
+    animation.numFrames = numframes;
+
+    for (int i = 0; i < numbones; ++i)
+    {
+        const mstudiobone_t& bone = pbones[i];
+        const mstudioanim_t& anim = panims[i];
+
+        for (int j = 0; j < ANIM_CHANNELS; ++j)
+        {
+            animation.bases.push_back(bone.value[j]);
+            animation.scales.push_back(bone.scale[j]);
+            animation.firstSpan.push_back((uint32_t)animation.spanFrames.size());
+
+            if (anim.offset[j] == 0) continue;
+
+            // The validator walked the same spans, they cover numframes
+            const mstudioanimvalue_t* span = (const mstudioanimvalue_t *)((const byte *)&anim + anim.offset[j]);
+
+            for (int frame = 0; frame < numframes; frame += span->num.total, span += span->num.valid + 1)
+            {
+                animation.spanFrames.push_back(frame);
+                animation.spanValues.push_back((uint32_t)animation.values.size());
+                animation.values.insert(animation.values.end(), span, span + span->num.valid + 1);
+            }
+        }
+    }
+
+    animation.firstSpan.push_back((uint32_t)animation.spanFrames.size());
+}
+
+void sampleAnimation(const CompressedAnimation& animation, int frame, float* values)
+{
+    int channels = animation.numBones * ANIM_CHANNELS;
+
+    for (int c = 0; c < channels; ++c)
+    {
+        auto first = animation.spanFrames.begin() + animation.firstSpan[c];
+        auto last = animation.spanFrames.begin() + animation.firstSpan[c + 1];
+
+        if (first == last)
+        {
+            values[c] = animation.bases[c];
+            continue;
+        }
+
+        // Last span starting at or before the frame
+        auto it = std::upper_bound(first + 1, last, frame) - 1;
+
+        const mstudioanimvalue_t* span = &animation.values[animation.spanValues[it - animation.spanFrames.begin()]];
+        int k = frame - *it;
+
+        short value = span->num.valid > k ? span[k + 1].value : span[span->num.valid].value;
+
+        values[c] = animation.bases[c] + value * animation.scales[c];
+    }
+}
@@ -0,0 +1,71 @@
+//
+//  Animation.h
+//  hlmv
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <glm/gtc/quaternion.hpp>
+#include "studio.h"
+
+// Bone channels in the order of mstudioanim_t::offset and mstudiobone_t::value
+const int ANIM_CHANNELS = 6;
+
+// Expands one run length encoded channel into `numframes` values, each
+// `base + value * scale`, written `stride` floats apart. The cursor moves
+// through the spans once, so a channel costs O(numframes) instead of a
+// walk from the first span for every frame. `pvalues` is null for
+// channels without animation, which stay at `base`.
+void decodeAnimChannel(const mstudioanimvalue_t* pvalues, int numframes, float base, float scale, float* out, size_t stride);
+
+// Every channel of every bone of one blend of a validated sequence,
+// laid out [frame][bone][channel]: position X, Y, Z, then Euler angles
+void decodeAnimation(const mstudiobone_t* pbones, const mstudioanim_t* panims, int numbones, int numframes, float* values);
+
+// Same rotations as glm::quat(glm::vec3(x, y, z)) for `count` Euler angle
+// triples `stride` floats apart, e.g. ANIM_CHANNELS apart starting at
+// channel 3 of decodeAnimation output. Angles go through a polynomial
+// sincos in blocks the compiler turns into vector code; components stay
+// within SINCOS_MAX_ERROR of glm. Angles beyond SINCOS_MAX_ANGLE fall
+// back to the C library.
+void eulerToQuaternions(const float* angles, size_t stride, size_t count, glm::quat* rotations);
+
+const float SINCOS_MAX_ERROR = 1e-6f;
+const float SINCOS_MAX_ANGLE = 8192.0f;
+
+// The run length encoded spans of a sequence, copied out of the file,
+// with the first frame of every span as a seek index. Takes about as much
+// memory as the animation in the file and any frame is a binary search
+// per channel away.
+struct CompressedAnimation
+{
+    int numBones = 0;
+    int numFrames = 0;
+
+    // Per channel, [bone][channel]
+    std::vector<float> bases;
+    std::vector<float> scales;
+
+    // Spans of channel c are [firstSpan[c], firstSpan[c + 1]), channels
+    // without animation have none and stay at their base
+    std::vector<uint32_t> firstSpan;
+
+    // First frame of each span and where its header is in `values`
+    std::vector<int> spanFrames;
+    std::vector<uint32_t> spanValues;
+
+    std::vector<mstudioanimvalue_t> values;
+
+    bool empty() const { return numFrames == 0; }
+
+    // Bytes held, for comparison with expanded frames
+    size_t size() const;
+};
+
+void compressAnimation(const mstudiobone_t* pbones, const mstudioanim_t* panims, int numbones, int numframes, CompressedAnimation& animation);
+
+// The channels of every bone in one frame, [bone][channel] as decodeAnimation
+void sampleAnimation(const CompressedAnimation& animation, int frame, float* values);
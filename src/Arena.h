@@ -0,0 +1,58 @@
+//
+//  Arena.h
+//  hlmv
+//
+
+#pragma once
+
+#include <memory>
+#include <span>
+#include <stddef.h>
+#include "studio.h"
+
+// One block for many buffers whose sizes are known up front. Everything is
+// reserved first, then the block is allocated and the same sequence of
+// calls to take() hands out the spans. Buffers are never freed on their
+// own, dropping the block frees all of them.
+class Arena
+{
+public:
+    template<class T>
+    void reserve(size_t count)
+    {
+        m_size = align<T>(m_size) + count * sizeof(T);
+    }
+
+    // Uninitialized, every span is filled by its owner
+    std::shared_ptr<byte[]> allocate()
+    {
+        m_block = std::shared_ptr<byte[]>(new byte[m_size > 0 ? m_size : 1]);
+        m_offset = 0;
+
+        return m_block;
+    }
+
+    template<class T>
+    std::span<T> take(size_t count)
+    {
+        m_offset = align<T>(m_offset);
+
+        T* items = (T *)(m_block.get() + m_offset);
+        m_offset += count * sizeof(T);
+
+        return { items, count };
+    }
+
+    size_t size() const { return m_size; }
+
+private:
+    template<class T>
+    static size_t align(size_t offset)
+    {
+        return (offset + alignof(T) - 1) & ~(alignof(T) - 1);
+    }
+
+    std::shared_ptr<byte[]> m_block;
+    size_t m_size = 0;
+    size_t m_offset = 0;
+};
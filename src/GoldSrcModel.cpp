@@ -6,43 +6,188 @@
 //
 
 #include "GoldSrcModel.h"
+#include "Animation.h"
+#include "Arena.h"
 #include "studio.h"
+#include "MappedFile.h"
+#include "MeshOptimizer.h"
+#include "ModelValidator.h"
+#include "ModelCache.h"
+#include "SequenceCache.h"
+#include "TextureCompression.h"
+#include "ThreadPool.h"
 #include <span>
+#include <future>
 #include <math.h>
+#include <string.h>
 
-void Model::loadFromFile(const std::string &filename)
+// Names in the file are fixed size and not always null terminated
+template<size_t N>
+static std::string makeString(const char (&name)[N])
 {
-    long size;
-    void *buffer;
-    
-    FILE* fp = fopen(filename.c_str(), "rb" );
+    return std::string(name, strnlen(name, N));
+}
+
+static void adviseTextures(const MappedFile& file);
+static std::shared_ptr<MappedFile> openTextureFile(const std::string& filename, const ModelLoadOptions& options);
 
-    if(fp == nullptr) {
+bool Model::loadFromFile(const std::string &filename, const ModelLoadOptions& options)
+{
+    auto file = std::make_shared<MappedFile>();
+    
+    if (!file->open(filename, options.useMmap))
+    {
         printf("unable to open %s\n", filename.c_str());
+        return false;
     }
+    
+    return load(file, filename, options);
+}
 
-    fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    buffer = malloc(size);
-    fread(buffer, size, 1, fp);
+bool Model::loadFromMemory(std::span<const byte> data, const ModelLoadOptions& options)
+{
+    auto file = std::make_shared<MappedFile>();
+    file->assign(data);
+    
+    return load(file, "", options);
+}
 
-    m_pin = (byte *)buffer;
-    m_pheader = (studiohdr_t *)m_pin;
+// An empty filename is a model from memory, without companion files or cache
+bool Model::load(std::shared_ptr<MappedFile> file, const std::string& filename, const ModelLoadOptions& options)
+{
+    std::string error;
+    
+    if (!validateModel(file->data(), error))
+    {
+        printf("%s is not a valid studio model: %s\n", filename.empty() ? "model" : filename.c_str(), error.c_str());
+        return false;
+    }
+    
+    m_data = file->data();
+    m_pin = m_data.data();
+    m_pheader = (const studiohdr_t *)m_pin;
+    
+    name = makeString(m_pheader->name);
+    m_parallel = options.parallel;
+    m_progress = options.progress;
+    
+    setProgress(0.05);
+    
+    if (options.verbose)
+    {
+        printf("------------ READ HEADER --------------\n");
+        printf("filename %s\n", filename.c_str());
+        printf("name: %s\n", name.c_str());
+        printf("version: %i\n", m_pheader->version);
+        printf("mapped: %s\n", file->isMapped() ? "yes" : "no");
+        printf("---------------------------------------\n");
+    }
+    
+    uint64_t hash = 0;
+    std::string cachePath;
+    
+    if (!options.cacheDirectory.empty() && !filename.empty())
+    {
+        hash = hashModelFiles(filename, file->data());
+        cachePath = modelCachePath(options.cacheDirectory, hash);
+        
+        if (auto cacheFile = readModelCache(cachePath, hash, options, *this))
+        {
+            if (options.verbose) printf("read cache %s\n", cachePath.c_str());
+            
+            // The cache holds expanded frames, compressed sequences are
+            // read from the model instead
+            createSequenceCache(file, filename, options, options.compressedAnimations ? nullptr : cacheFile);
+            
+            // Only compressed skins can add files on a hit
+            if (options.compressTextures)
+            {
+                compressTextures(options.cacheDirectory);
+                
+                if (options.cacheSizeLimit > 0) {
+                    trimCacheDirectory(options.cacheDirectory, options.cacheSizeLimit);
+                }
+            }
+            
+            m_pin = nullptr;
+            m_pheader = nullptr;
+            m_data = {};
+            
+            setProgress(1.0);
+            m_progress = nullptr;
+            
+            return true;
+        }
+    }
+    
+    adviseTextures(*file);
     
-    name = m_pheader->name;
+    // Lazily decoded sequences touch only a few pages of the animation block
+    if (m_pheader->numseq > 0 && !options.lazySequences)
+    {
+        auto [offset, length] = animationRange();
+        file->advise(offset, length, MappedFile::Advice::WillNeed);
+    }
+    
+    std::shared_ptr<MappedFile> textureFile;
+    
+    if (m_pheader->textureindex == 0 && !filename.empty())
+    {
+        // Skins live in modelT.mdl. It is opened and validated on a second
+        // thread while this one reads the sequences, the meshes need its
+        // header for the texture sizes.
+        auto opened = std::async(std::launch::async, [&filename, &options]() {
+            return openTextureFile(filename, options);
+        });
+        
+        readSequence();
+        
+        textureFile = opened.get();
+        m_ptexturehdr = textureFile ? (const studiohdr_t *)textureFile->data().data() : m_pheader;
+    }
+    else
+    {
+        m_ptexturehdr = m_pheader;
+        
+        readSequence();
+    }
     
-    printf("------------ READ HEADER --------------\n");
-    printf("filename %s\n", filename.c_str());
-    printf("name: %s\n", m_pheader->name);
-    printf("version: %i\n", m_pheader->version);
-    printf("---------------------------------------\n");
+    readSkinFamilies();
     
-    readTextures();
-    readBodyparts();
-    readSequence();
+    std::vector<MeshData> meshJobs = gatherMeshes();
+    allocateArena((const byte *)m_ptexturehdr, meshJobs);
     
-    mstudiobone_t* pbone = (mstudiobone_t *)(m_pin + m_pheader->boneindex);
+    if (textureFile)
+    {
+        // Each side fills its own part of the arena
+        auto texturesRead = std::async(std::launch::async, [this, &textureFile]() {
+            readTextures(textureFile->data().data());
+        });
+        
+        readBodyparts(meshJobs);
+        
+        texturesRead.get();
+    }
+    else
+    {
+        readTextures(m_pin);
+        readBodyparts(meshJobs);
+    }
+    
+    if (isCancelled())
+    {
+        m_pin = nullptr;
+        m_pheader = nullptr;
+        m_ptexturehdr = nullptr;
+        m_data = {};
+        m_progress = nullptr;
+        
+        return false;
+    }
+    
+    createSequenceCache(file, filename, options);
+    
+    const mstudiobone_t* pbone = (const mstudiobone_t *)(m_pin + m_pheader->boneindex);
     bones.resize(m_pheader->numbones);
     
     for (int i = 0; i < m_pheader->numbones; ++i)
@@ -50,131 +195,420 @@ void Model::loadFromFile(const std::string &filename)
         bones[i] = pbone[i].parent;
     }
     
-    free(buffer);
-    fclose(fp);
+    if (!cachePath.empty() && writeModelCache(cachePath, hash, *this))
+    {
+        if (options.verbose) printf("wrote cache %s\n", cachePath.c_str());
+    }
+    
+    if (options.compressTextures) {
+        compressTextures(options.cacheDirectory);
+    }
+    
+    if (!cachePath.empty() && options.cacheSizeLimit > 0) {
+        trimCacheDirectory(options.cacheDirectory, options.cacheSizeLimit);
+    }
+    
+    m_pin = nullptr;
+    m_pheader = nullptr;
+    m_ptexturehdr = nullptr;
+    m_data = {};
+    
+    setProgress(1.0);
+    m_progress = nullptr;
+    
+    return true;
 }
 
-void makeTexture(byte* pin, mstudiotexture_t& texInfo, Texture& texture);
+// Results are written to preallocated slots, so the order does not depend
+// on how the pool schedules the items. Once the load is cancelled the
+// remaining items are skipped.
+void Model::forEachIndex(size_t count, float progressFrom, float progressTo, const std::function<void(size_t)>& fn)
+{
+    std::atomic<size_t> done = 0;
+    
+    auto run = [&](size_t i) {
+        
+        if (isCancelled()) return;
+        
+        fn(i);
+        
+        setProgress(progressFrom + (progressTo - progressFrom) * float(++done) / count);
+    };
+    
+    if (m_parallel)
+    {
+        ThreadPool::instance().parallelFor(count, run);
+        return;
+    }
+    
+    for (size_t i = 0; i < count; ++i)
+    {
+        run(i);
+    }
+}
 
-void Model::readTextures()
+// Stages can overlap, only ever move forward
+void Model::setProgress(float value)
 {
-    if (m_pheader == nullptr) return;
-    if (m_pheader->textureindex == 0) return;
+    if (m_progress == nullptr) return;
     
-    mstudiotexture_t* ptextures = (mstudiotexture_t *)(m_pin + m_pheader->textureindex);
+    float current = m_progress->value;
     
-    for (int i = 0; i < m_pheader->numtextures; ++i)
+    while (current < value && !m_progress->value.compare_exchange_weak(current, value))
     {
-        Texture texture;
-        makeTexture(m_pin, ptextures[i], texture);
         
-        textures.push_back(texture);
     }
 }
 
-void makeTexture(byte* pin, mstudiotexture_t& texInfo, Texture& texture)
+bool Model::isCancelled() const
 {
-    const int RGB_SIZE = 3;
-    const int RGBA_SIZE = 4;
+    return m_progress && m_progress->cancelled;
+}
+
+// Index planes and palettes are copied once, front to back
+static void adviseTextures(const MappedFile& file)
+{
+    const studiohdr_t* pheader = (const studiohdr_t *)file.data().data();
     
-    int offset = texInfo.index;
-    int count = texInfo.width * texInfo.height;
+    if (pheader->numtextures > 0 && pheader->texturedataindex > 0)
+    {
+        size_t offset = pheader->texturedataindex;
+        file.advise(offset, file.size() - offset, MappedFile::Advice::Sequential);
+        file.advise(offset, file.size() - offset, MappedFile::Advice::WillNeed);
+    }
+}
+
+static std::string stripExtension(const std::string& filename)
+{
+    size_t extension = filename.rfind('.');
+    if (extension == std::string::npos) return filename;
     
-    byte* data = (byte*)(pin + texInfo.index);
-    byte* palette = data + count;
+    return filename.substr(0, extension);
+}
+
+std::string textureFilename(const std::string& filename)
+{
+    return stripExtension(filename) + "T.mdl";
+}
+
+std::string sequenceGroupFilename(const std::string& filename, int group)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "%02d.mdl", group);
+    
+    return stripExtension(filename) + suffix;
+}
+
+static std::shared_ptr<MappedFile> openTextureFile(const std::string& filename, const ModelLoadOptions& options)
+{
+    std::string texturename = textureFilename(filename);
     
-    texture.data.resize(count * RGBA_SIZE);
+    auto file = std::make_shared<MappedFile>();
     
-    // Parsing indexed color: every item in texture data is index of color in colors palette
-    for (int i = 0; i < count; ++i)
+    if (!file->open(texturename, options.useMmap))
     {
-        byte item = data[i];
+        printf("unable to open %s\n", texturename.c_str());
+        return nullptr;
+    }
+    
+    std::string error;
+    
+    if (!validateModel(file->data(), error))
+    {
+        printf("%s is not a valid texture file: %s\n", texturename.c_str(), error.c_str());
+        return nullptr;
+    }
+    
+    adviseTextures(*file);
+    
+    return file;
+}
+
+// Animation values are written by studiomdl as one block in front of the
+// sequence descriptions, so the block ends at the next section after it
+std::pair<size_t, size_t> Model::animationRange() const
+{
+    const mstudioseqdesc_t* psequences = (const mstudioseqdesc_t *)(m_pin + m_pheader->seqindex);
+    
+    size_t begin = m_data.size();
+    
+    for (int i = 0; i < m_pheader->numseq; ++i)
+    {
+        if (psequences[i].seqgroup == 0 && (size_t)psequences[i].animindex < begin) {
+            begin = psequences[i].animindex;
+        }
+    }
+    
+    size_t end = m_data.size();
+    
+    const int sections[] = {
+        m_pheader->boneindex, m_pheader->bonecontrollerindex, m_pheader->hitboxindex,
+        m_pheader->seqindex, m_pheader->seqgroupindex, m_pheader->textureindex,
+        m_pheader->texturedataindex, m_pheader->skinindex, m_pheader->bodypartindex,
+        m_pheader->attachmentindex, m_pheader->transitionindex
+    };
+    
+    for (int offset : sections)
+    {
+        if (offset > 0 && (size_t)offset > begin && (size_t)offset < end) {
+            end = offset;
+        }
+    }
+    
+    if (begin >= end) return { 0, 0 };
+    
+    return { begin, end - begin };
+}
 
-        int paletteOffset = int(item) * RGB_SIZE;
-        int pixelOffset = i * RGBA_SIZE;
+void makeTexture(const byte* pin, const mstudiotexture_t& texInfo, Texture& texture);
 
-        // Just applying to texture image data
-        texture.data[pixelOffset + 0] = palette[paletteOffset + 0]; // red
-        texture.data[pixelOffset + 1] = palette[paletteOffset + 1]; // green
-        texture.data[pixelOffset + 2] = palette[paletteOffset + 2]; // blue
-        texture.data[pixelOffset + 3] = 255; // alpha
+// Spans were handed out by allocateArena
+void Model::readTextures(const byte* ptexturein)
+{
+    const studiohdr_t* ptexturehdr = (const studiohdr_t *)ptexturein;
+    if (ptexturehdr->textureindex == 0) return;
+    
+    const mstudiotexture_t* ptextures = (const mstudiotexture_t *)(ptexturein + ptexturehdr->textureindex);
+    
+    forEachIndex(textures.size(), 0.05, 0.5, [this, ptexturein, ptextures](size_t i) {
+        makeTexture(ptexturein, ptextures[i], textures[i]);
+    });
+}
+
+// The table lives next to the textures, in the T-file when there is one
+void Model::readSkinFamilies()
+{
+    skinFamilies.clear();
+    
+    if (m_ptexturehdr->textureindex == 0) return;
+    
+    const byte* ptexturein = (const byte *)m_ptexturehdr;
+    const int16_t* pskinrefs = (const int16_t *)(ptexturein + m_ptexturehdr->skinindex);
+    
+    for (int i = 0; i < m_ptexturehdr->numskinfamilies; ++i)
+    {
+        const int16_t* family = pskinrefs + i * m_ptexturehdr->numskinref;
+        skinFamilies.emplace_back(family, family + m_ptexturehdr->numskinref);
     }
+}
+
+void makeTexture(const byte* pin, const mstudiotexture_t& texInfo, Texture& texture)
+{
+    const int PALETTE_SIZE = 256 * 3;
+    
+    int count = texInfo.width * texInfo.height;
+    
+    // Every item in texture data is an index into the palette that follows it.
+    // Both are kept as they are, the lookup happens on the GPU.
+    const byte* data = (const byte*)(pin + texInfo.index);
+    const byte* palette = data + count;
+    
+    memcpy(texture.indices.data(), data, count);
+    memcpy(texture.palette.data(), palette, PALETTE_SIZE);
     
-    texture.name = texInfo.name;
+    texture.name = makeString(texInfo.name);
     texture.width = texInfo.width;
     texture.height = texInfo.height;
+    texture.flags = texInfo.flags;
+}
+
+// Encoding is the slow part, skins found in the cache are only read
+void Model::compressTextures(const std::string& cacheDirectory)
+{
+    forEachIndex(textures.size(), 0.9, 1.0, [this, &cacheDirectory](size_t i) {
+        
+        Texture& texture = textures[i];
+        
+        if (cacheDirectory.empty())
+        {
+            texture.compressed = compressTexture(texture);
+            return;
+        }
+        
+        uint64_t hash = hashTexture(texture);
+        std::string path = textureCachePath(cacheDirectory, hash);
+        
+        texture.compressed = readTextureCache(path, hash);
+        if (texture.compressed) return;
+        
+        texture.compressed = compressTexture(texture);
+        
+        if (texture.compressed) {
+            writeTextureCache(path, hash, *texture.compressed);
+        }
+    });
 }
 
 struct MeshData
 {
-    std::span<int16_t>& triverts;
-    std::span<float>& vertices;
-    std::span<float>& normals;
-    mstudiotexture_t* ptexture;
-    std::span<uint8_t>& boneIndices;
+    std::span<const int16_t> triverts;
+    std::span<const float> vertices;
+    std::span<const float> normals;
+    const mstudiotexture_t* ptexture;
+    std::span<const uint8_t> boneIndices;
+    int textureIndex;
+    int skinRef;
+    
+    // Strip and fan entries and the indices they unpack to, counted
+    // before the arena is allocated
+    size_t entriesCount;
+    size_t indicesCount;
+    
+    // Room for every entry, welding uses only the front
+    std::span<MeshVertex> vertexStorage;
+    std::span<unsigned int> indexStorage;
 };
 
+static void countMesh(std::span<const int16_t> triverts, size_t& entriesCount, size_t& indicesCount)
+{
+    entriesCount = 0;
+    indicesCount = 0;
+    
+    for (size_t pos = 0; triverts[pos]; )
+    {
+        size_t count = abs(triverts[pos]);
+        
+        // The first three entries make one triangle, every further one adds another
+        entriesCount += count;
+        indicesCount += count > 3 ? count + (count - 3) * 2 : count;
+        
+        pos += 1 + count * 4;
+    }
+}
+
 void makeMesh(const MeshData& data, Mesh& mesh);
 
-void Model::readBodyparts()
+std::vector<MeshData> Model::gatherMeshes() const
 {
-    mstudiobodyparts_t* pbodyparts = (mstudiobodyparts_t *)(m_pin + m_pheader->bodypartindex);
-    std::span<mstudiobodyparts_t> bodyparts(pbodyparts, m_pheader->numbodyparts);
+    std::vector<MeshData> jobs;
+    
+    const mstudiobodyparts_t* pbodyparts = (const mstudiobodyparts_t *)(m_pin + m_pheader->bodypartindex);
+    std::span<const mstudiobodyparts_t> bodyparts(pbodyparts, m_pheader->numbodyparts);
     
     for (auto& bodypart : bodyparts)
     {
-        mstudiomodel_t* pmodels = (mstudiomodel_t *)(m_pin + bodypart.modelindex);
-        std::span<mstudiomodel_t> models(pmodels, bodypart.nummodels);
+        const mstudiomodel_t* pmodels = (const mstudiomodel_t *)(m_pin + bodypart.modelindex);
+        std::span<const mstudiomodel_t> models(pmodels, bodypart.nummodels);
         
         for (auto& model : models)
         {
-            float* pverts = (float *)(m_pin + model.vertindex);
-            std::span<float> verts(pverts, model.numverts * 3);
+            const float* pverts = (const float *)(m_pin + model.vertindex);
+            std::span<const float> verts(pverts, model.numverts * 3);
             
-            float* pnorms = (float *)(m_pin + model.normindex);
-            std::span<float> norms(pnorms, model.numnorms * 3);
+            const float* pnorms = (const float *)(m_pin + model.normindex);
+            std::span<const float> norms(pnorms, model.numnorms * 3);
             
-            uint8_t* pvert_infos = (uint8_t *)(m_pin + model.vertinfoindex);
-            std::span<uint8_t> vert_infos(pvert_infos, model.numverts);
+            const uint8_t* pvert_infos = (const uint8_t *)(m_pin + model.vertinfoindex);
+            std::span<const uint8_t> vert_infos(pvert_infos, model.numverts);
             
-            mstudiomesh_t* pmeshes = (mstudiomesh_t *)(m_pin + model.meshindex);
-            std::span<mstudiomesh_t> meshes(pmeshes, model.nummesh);
+            const mstudiomesh_t* pmeshes = (const mstudiomesh_t *)(m_pin + model.meshindex);
+            std::span<const mstudiomesh_t> meshes(pmeshes, model.nummesh);
             
             for (auto& mesh : meshes)
             {
-                int tris_count = floor((m_pheader->length - mesh.triindex) / 2);
-                int16_t* ptris = (int16_t *)(m_pin + mesh.triindex);
-                std::span<int16_t> tris(ptris, tris_count);
+                // The command stream is zero terminated and was walked by the validator,
+                // the span only has to cover the rest of the file
+                size_t tris_count = (m_data.size() - mesh.triindex) / sizeof(int16_t);
+                const int16_t* ptris = (const int16_t *)(m_pin + mesh.triindex);
+                std::span<const int16_t> tris(ptris, tris_count);
                 
-                mstudiotexture_t* ptexture = nullptr;
+                const mstudiotexture_t* ptexture = nullptr;
+                int textureIndex = -1;
+                int skinRef = -1;
                 
-                Mesh result;
+                // Skin table and texture sizes come from the texture file if there is one.
+                // Only tables with at least one family were checked by the validator.
+                const byte* ptexturein = (const byte *)m_ptexturehdr;
+                bool hasSkins = m_ptexturehdr->textureindex != 0 && m_ptexturehdr->numskinfamilies > 0;
                 
-                if (mesh.skinref < m_pheader->numskinref)
+                if (mesh.skinref < m_ptexturehdr->numskinref && hasSkins)
                 {
-                    int16_t* skinrefs = (int16_t *)(m_pin + m_pheader->skinindex);
+                    const int16_t* skinrefs = (const int16_t *)(ptexturein + m_ptexturehdr->skinindex);
                     int16_t texture_index = skinrefs[mesh.skinref];
                     
-                    mstudiotexture_t* ptextures = (mstudiotexture_t *)(m_pin + m_pheader->textureindex);
+                    const mstudiotexture_t* ptextures = (const mstudiotexture_t *)(ptexturein + m_ptexturehdr->textureindex);
                     ptexture = &ptextures[texture_index];
                     
-                    result.textureIndex = texture_index;
+                    textureIndex = texture_index;
+                    skinRef = mesh.skinref;
                 }
                 
-                MeshData data = {
+                MeshData& job = jobs.emplace_back(MeshData {
                     .triverts = tris,
                     .vertices = verts,
                     .normals = norms,
                     .ptexture = ptexture,
-                    .boneIndices = vert_infos
-                };
+                    .boneIndices = vert_infos,
+                    .textureIndex = textureIndex,
+                    .skinRef = skinRef,
+                    .entriesCount = 0,
+                    .indicesCount = 0,
+                    .vertexStorage = {},
+                    .indexStorage = {}
+                });
                 
-                makeMesh(data, result);
-                
-                this->meshes.push_back(result);
+                countMesh(tris, job.entriesCount, job.indicesCount);
             }
         }
     }
+    
+    return jobs;
+}
+
+// Two passes over the same order: reserve everything, then take the spans
+void Model::allocateArena(const byte* ptexturein, std::vector<MeshData>& meshJobs)
+{
+    const int PALETTE_SIZE = 256 * 3;
+    
+    const studiohdr_t* ptexturehdr = (const studiohdr_t *)ptexturein;
+    std::span<const mstudiotexture_t> textureInfos;
+    
+    if (ptexturehdr->textureindex != 0)
+    {
+        const mstudiotexture_t* ptextures = (const mstudiotexture_t *)(ptexturein + ptexturehdr->textureindex);
+        textureInfos = { ptextures, (size_t)ptexturehdr->numtextures };
+    }
+    
+    Arena layout;
+    
+    for (auto& texInfo : textureInfos)
+    {
+        layout.reserve<unsigned char>(texInfo.width * texInfo.height);
+        layout.reserve<unsigned char>(PALETTE_SIZE);
+    }
+    
+    for (auto& job : meshJobs)
+    {
+        layout.reserve<MeshVertex>(job.entriesCount);
+        layout.reserve<unsigned int>(job.indicesCount);
+    }
+    
+    arena = layout.allocate();
+    
+    textures.resize(textureInfos.size());
+    
+    for (size_t i = 0; i < textureInfos.size(); ++i)
+    {
+        textures[i].indices = layout.take<unsigned char>(textureInfos[i].width * textureInfos[i].height);
+        textures[i].palette = layout.take<unsigned char>(PALETTE_SIZE);
+    }
+    
+    for (auto& job : meshJobs)
+    {
+        job.vertexStorage = layout.take<MeshVertex>(job.entriesCount);
+        job.indexStorage = layout.take<unsigned int>(job.indicesCount);
+    }
+}
+
+void Model::readBodyparts(const std::vector<MeshData>& meshJobs)
+{
+    this->meshes.resize(meshJobs.size());
+    
+    forEachIndex(meshJobs.size(), 0.5, 0.9, [this, &meshJobs](size_t i) {
+        this->meshes[i].textureIndex = meshJobs[i].textureIndex;
+        this->meshes[i].skinRef = meshJobs[i].skinRef;
+        makeMesh(meshJobs[i], this->meshes[i]);
+    });
 }
 
 void makeMesh(const MeshData& data, Mesh& mesh)
@@ -185,16 +619,25 @@ void makeMesh(const MeshData& data, Mesh& mesh)
         TRIANGLE_STRIP
     };
     
-    struct vert_t
-    {
-        glm::vec3 pos;
-        glm::vec3 nrm;
-        glm::vec2 uv;
-        int vindex;
-    };
+    std::span<MeshVertex> verticesData = data.vertexStorage;
+    std::span<unsigned int> indicesData = data.indexStorage;
+    
+    size_t verticesCount = 0;
+    size_t indicesCount = 0;
     
-    std::vector<vert_t> verticesData;
-    std::vector<unsigned int> indicesData;
+    // Strips and fans share their edge vertices, every (vertex, normal, s, t)
+    // command entry is kept once and later entries reuse its index. The
+    // table is open addressed and at most half full.
+    size_t tableSize = 16;
+    
+    while (tableSize < data.entriesCount * 2) {
+        tableSize *= 2;
+    }
+    
+    const unsigned int EMPTY_SLOT = ~0u;
+    
+    std::vector<uint64_t> weldKeys(tableSize);
+    std::vector<unsigned int> weldIndices(tableSize, EMPTY_SLOT);
     
     int textureWidth = 64;
     int textureHeight = 64;
@@ -207,7 +650,7 @@ void makeMesh(const MeshData& data, Mesh& mesh)
     
     int trisPos = 0;
     
-    int verticesCount = 0;
+    int entriesCount = 0;
     
     // Processing triangle series
     while (data.triverts[trisPos])
@@ -233,19 +676,38 @@ void makeMesh(const MeshData& data, Mesh& mesh)
         for (int j = 0; j < trianglesNum; ++j)
         {
             int vertIndex = data.triverts[trisPos];
-            int vert = data.triverts[trisPos] * 3;
-            int norm = data.triverts[trisPos + 1] * 3;
+            int normIndex = data.triverts[trisPos + 1];
             
-            float u_offset = (float)data.triverts[trisPos + 2] / textureWidth;
-            float v_offset = (float)data.triverts[trisPos + 3] / textureHeight;
+            // The four shorts of the entry are the key
+            uint64_t key = 0;
+            memcpy(&key, &data.triverts[trisPos], sizeof(key));
             
-            // Vertex data
-            vert_t vertexData = {
-                .pos = {data.vertices[vert + 0], data.vertices[vert + 1], data.vertices[vert + 2]},
-                .nrm = {data.normals[norm + 0], data.normals[norm + 1], data.normals[norm + 2]},
-                .uv = { u_offset, v_offset},
-                .vindex = vertIndex
-            };
+            size_t slot = (key * 0x9e3779b97f4a7c15ull >> 32) & (tableSize - 1);
+            
+            while (weldIndices[slot] != EMPTY_SLOT && weldKeys[slot] != key) {
+                slot = (slot + 1) & (tableSize - 1);
+            }
+            
+            if (weldIndices[slot] == EMPTY_SLOT)
+            {
+                weldKeys[slot] = key;
+                weldIndices[slot] = (unsigned int)verticesCount;
+                
+                int vert = vertIndex * 3;
+                int norm = normIndex * 3;
+                
+                float u_offset = (float)data.triverts[trisPos + 2] / textureWidth;
+                float v_offset = (float)data.triverts[trisPos + 3] / textureHeight;
+                
+                verticesData[verticesCount++] = {
+                    .position = {data.vertices[vert + 0], data.vertices[vert + 1], data.vertices[vert + 2]},
+                    .normal = {data.normals[norm + 0], data.normals[norm + 1], data.normals[norm + 2]},
+                    .texCoord = {u_offset, v_offset},
+                    .boneIndex = data.boneIndices[vertIndex]
+                };
+            }
+            
+            unsigned int index = weldIndices[slot];
             
             trisPos += 4;
 
@@ -263,18 +725,20 @@ void makeMesh(const MeshData& data, Mesh& mesh)
                     if (j % 2 == 0)
                     {
                         // even
-                        indicesData.insert(indicesData.end(), {
-                            indicesData[indicesData.size() - 3], // previously first one
-                            indicesData[indicesData.size() - 1]  // last one
-                        });
+                        unsigned int first = indicesData[indicesCount - 3]; // previously first one
+                        unsigned int last = indicesData[indicesCount - 1];  // last one
+                        
+                        indicesData[indicesCount++] = first;
+                        indicesData[indicesCount++] = last;
                     }
                     else
                     {
                         // odd
-                        indicesData.insert(indicesData.end(), {
-                            indicesData[indicesData.size() - 1], // last one
-                            indicesData[indicesData.size() - 2]  // second to last
-                        });
+                        unsigned int last = indicesData[indicesCount - 1];   // last one
+                        unsigned int second = indicesData[indicesCount - 2]; // second to last
+                        
+                        indicesData[indicesCount++] = last;
+                        indicesData[indicesCount++] = second;
                     }
                 }
             }
@@ -290,186 +754,115 @@ void makeMesh(const MeshData& data, Mesh& mesh)
             {
                 if (startVertIndex == -1)
                 {
-                    startVertIndex = verticesCount;
+                    startVertIndex = index;
                 }
 
                 if (j > 2)
                 {
-                    indicesData.insert(indicesData.end(), {
-                        (unsigned int)startVertIndex,
-                        indicesData[indicesData.size() - 1]
-                    });
+                    unsigned int last = indicesData[indicesCount - 1];
+                    
+                    indicesData[indicesCount++] = (unsigned int)startVertIndex;
+                    indicesData[indicesCount++] = last;
                 }
             }
 
             // New one
-            indicesData.push_back(verticesCount);
-            verticesData.push_back(vertexData);
+            indicesData[indicesCount++] = index;
             
-            verticesCount++;
+            entriesCount++;
         }
     }
     
-    std::vector<MeshVertex> meshVerts;
-    meshVerts.resize(verticesCount);
-
-    for (int i = 0; i < verticesCount; ++i)
-    {
-        int vertIndex = verticesData[i].vindex;
-        int boneIndex = data.boneIndices[vertIndex];
-        
-        meshVerts[i].position = verticesData[i].pos;
-        meshVerts[i].normal = verticesData[i].nrm;
-        meshVerts[i].texCoord = verticesData[i].uv;
-        meshVerts[i].boneIndex = boneIndex;
-    }
+    // Strip order leaves most of the post-transform cache unused
+    mesh.vertexBuffer = verticesData.first(verticesCount);
+    mesh.indexBuffer = indicesData.first(indicesCount);
+    mesh.sourceVertexCount = entriesCount;
     
-    mesh.vertexBuffer = meshVerts;
-    mesh.indexBuffer = indicesData;
+    mesh.sourceCacheMisses = (int)countCacheMisses(mesh.indexBuffer, verticesCount);
+    optimizeVertexCache(mesh.indexBuffer, verticesCount);
 }
 
-void calcBoneRotation(int frame, mstudiobone_t *pbone, mstudioanim_t *panim, float *angle);
-void calcBonePosition(int frame, mstudiobone_t *pbone, mstudioanim_t *panim, float *pos);
-
 void Model::readSequence()
 {
-    mstudioseqdesc_t* psequences = (mstudioseqdesc_t *)(m_pin + m_pheader->seqindex);
-    std::span<mstudioseqdesc_t> sequences(psequences, m_pheader->numseq);
+    const mstudioseqdesc_t* psequences = (const mstudioseqdesc_t *)(m_pin + m_pheader->seqindex);
+    std::span<const mstudioseqdesc_t> sequences(psequences, m_pheader->numseq);
     
     for (auto& sequence : sequences)
     {
-        int fps = sequence.fps;
-        int numframes = sequence.numframes;
-        
 //        float groundSpeed = sqrt(sequence.linearmovement[0] * sequence.linearmovement[0] +
 //                                 sequence.linearmovement[1] * sequence.linearmovement[1] +
 //                                 sequence.linearmovement[2] * sequence.linearmovement[2]) * fps / (float(numframes) - 1);
         
         Sequence seq;
-        seq.name = sequence.label;
+        seq.name = makeString(sequence.label);
         seq.fps = sequence.fps;
         seq.groundSpeed = 0;
-        
-        for (int frame_idx = 0; frame_idx < numframes; ++frame_idx)
-        {
-            mstudiobone_t* pbone = (mstudiobone_t *)(m_pin + m_pheader->boneindex);
-            mstudioanim_t* panim = (mstudioanim_t *)(m_pin + sequence.animindex);
-            
-            vec3_t frame_pos[MAXSTUDIOBONES];
-            vec3_t frame_rot_euler[MAXSTUDIOBONES];
-            
-            for (int i = 0; i < m_pheader->numbones; i++, pbone++, panim++)
-            {
-                calcBoneRotation(frame_idx, pbone, panim, frame_rot_euler[i]);
-                calcBonePosition(frame_idx, pbone, panim, frame_pos[i]);
-            }
-            
-            Frame frame;
-            frame.rotationPerBone.resize(m_pheader->numbones);
-            frame.positionPerBone.resize(m_pheader->numbones);
-            
-            for (int i = 0; i < m_pheader->numbones; ++i)
-            {
-                glm::vec3 angle = { frame_rot_euler[i][0], frame_rot_euler[i][1], frame_rot_euler[i][2] };
-                
-                frame.rotationPerBone[i] = glm::quat(angle);
-                frame.positionPerBone[i] = { frame_pos[i][0], frame_pos[i][1], frame_pos[i][2] };
-            }
-            
-            seq.frames.push_back(frame);
-        }
+        seq.numFrames = sequence.numframes;
         
         this->sequences.push_back(seq);
     }
 }
 
-void calcBoneRotation(int frame, mstudiobone_t *pbone, mstudioanim_t *panim, float *angle)
+void Model::createSequenceCache(std::shared_ptr<const MappedFile> file, const std::string& filename, const ModelLoadOptions& options,
+                                std::shared_ptr<const MappedFile> cacheFile)
 {
-    int                    j, k;
-    mstudioanimvalue_t    *panimvalue;
-
-    for (j = 0; j < 3; j++)
+    if (options.lazySequences)
     {
-        if (panim->offset[j + 3] == 0)
-        {
-            angle[j] = pbone->value[j + 3]; // default;
-        }
-        else
-        {
-            panimvalue = (mstudioanimvalue_t *)((byte *)panim + panim->offset[j + 3]);
-            k = frame;
-            while (panimvalue->num.total <= k)
-            {
-                k -= panimvalue->num.total;
-                panimvalue += panimvalue->num.valid + 1;
-            }
-            // Bah, missing blend!
-            if (panimvalue->num.valid > k)
-            {
-                angle[j] = panimvalue[k + 1].value;
-            }
-            else
-            {
-                angle[j] = panimvalue[panimvalue->num.valid].value;
-            }
-            
-            angle[j] = pbone->value[j + 3] + angle[j] * pbone->scale[j + 3];
-        }
+        sequenceCache = std::make_shared<SequenceCache>(file, filename, options.sequenceCacheSize, options.useMmap,
+                                                        options.compressedAnimations, cacheFile);
+    }
+    else
+    {
+        // Decode everything now and never evict, the files are not needed afterwards
+        sequenceCache = std::make_shared<SequenceCache>(file, filename, sequences.size(), options.useMmap,
+                                                        options.compressedAnimations, cacheFile);
+        sequenceCache->decodeAll(options.parallel);
+        sequenceCache->releaseFile();
     }
 }
 
-void calcBonePosition(int frame, mstudiobone_t *pbone, mstudioanim_t *panim, float *pos)
+// Planes of a sequence from its channels, laid out as decodeAnimation writes them
+static void setFrames(const float* values, Sequence& seq)
 {
-    int                    j, k;
-    mstudioanimvalue_t    *panimvalue;
+    size_t count = (size_t)seq.numFrames * seq.numBones;
     
-    float s = 0.0;
-
-    for (j = 0; j < 3; j++)
+    seq.rotations.resize(count);
+    seq.positions.resize(count);
+    
+    for (size_t i = 0; i < count; ++i)
     {
-        pos[j] = pbone->value[j]; // default;
-        
-        if (panim->offset[j] != 0)
-        {
-            panimvalue = (mstudioanimvalue_t *)((byte *)panim + panim->offset[j]);
-
-            k = frame;
-            // find span of values that includes the frame we want
-            while (panimvalue->num.total <= k)
-            {
-                k -= panimvalue->num.total;
-                panimvalue += panimvalue->num.valid + 1;
-            }
-            // if we're inside the span
-            if (panimvalue->num.valid > k)
-            {
-                // and there's more data in the span
-                if (panimvalue->num.valid > k + 1)
-                {
-                    pos[j] += (panimvalue[k + 1].value * (1.0 - s) + s * panimvalue[k + 2].value) * pbone->scale[j];
-                }
-                else
-                {
-                    pos[j] += panimvalue[k + 1].value * pbone->scale[j];
-                }
-            }
-            else
-            {
-                // are we at the end of the repeating values section and there's another section with data?
-                if (panimvalue->num.total <= k + 1)
-                {
-                    pos[j] += (panimvalue[panimvalue->num.valid].value * (1.0 - s) + s * panimvalue[panimvalue->num.valid + 2].value) * pbone->scale[j];
-                }
-                else
-                {
-                    pos[j] += panimvalue[panimvalue->num.valid].value * pbone->scale[j];
-                }
-            }
-        }
+        const float* channels = values + i * ANIM_CHANNELS;
+        seq.positions[i] = { channels[0], channels[1], channels[2] };
+    }
+    
+    eulerToQuaternions(values + 3, ANIM_CHANNELS, count, seq.rotations.data());
+}
 
-//        if (pbone->bonecontroller[j] != -1)
-//        {
-//            pos[j] += m_adj[pbone->bonecontroller[j]];
-//        }
+void decodeSequence(const byte* pin, const byte* panimdata, int index, Sequence& seq, bool compressed)
+{
+    const studiohdr_t* pheader = (const studiohdr_t *)pin;
+    const mstudioseqdesc_t& sequence = ((const mstudioseqdesc_t *)(pin + pheader->seqindex))[index];
+    
+    int numframes = sequence.numframes;
+    
+    seq.name = makeString(sequence.label);
+    seq.fps = sequence.fps;
+    seq.groundSpeed = 0;
+    seq.numFrames = numframes;
+    seq.numBones = pheader->numbones;
+    
+    const mstudiobone_t* pbones = (const mstudiobone_t *)(pin + pheader->boneindex);
+    const mstudioanim_t* panims = (const mstudioanim_t *)(panimdata + sequence.animindex);
+    
+    if (compressed)
+    {
+        compressAnimation(pbones, panims, pheader->numbones, numframes, seq.animation);
+        return;
     }
+    
+    // Every channel is expanded in one pass over its spans
+    std::vector<float> values((size_t)numframes * pheader->numbones * ANIM_CHANNELS);
+    decodeAnimation(pbones, panims, pheader->numbones, numframes, values.data());
+    
+    setFrames(values.data(), seq);
 }
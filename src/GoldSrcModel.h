@@ -9,9 +9,14 @@
 
 #include <vector>
 #include <string>
+#include <span>
+#include <memory>
+#include <atomic>
+#include <functional>
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include "studio.h"
+#include "Animation.h"
 
 struct MeshVertex
 {
@@ -21,50 +26,187 @@ struct MeshVertex
     int boneIndex;
 };
 
+// Buffers of meshes and textures are spans into Model::arena
+
 struct Mesh
 {
-    std::vector<MeshVertex> vertexBuffer;
-    std::vector<unsigned int> indexBuffer;
-    int textureIndex;
+    std::span<MeshVertex> vertexBuffer;
+    std::span<unsigned int> indexBuffer;
+    
+    // Strip and fan entries the mesh was unpacked from, one vertex each
+    // before identical entries were welded
+    int sourceVertexCount = 0;
+    
+    // Vertex cache misses of the unpacked triangle order, before the
+    // triangles were reordered for the cache
+    int sourceCacheMisses = 0;
+    
+    // Texture of skin family 0, texture coordinates are normalized to its size
+    int textureIndex = -1;
+    
+    // Slot in Model::skinFamilies, picks the texture of the other families
+    int skinRef = -1;
 };
 
+struct CompressedTexture;
+
 struct Texture
 {
     std::string name;
-    std::vector<unsigned char> data;
+    
+    // 8-bit indices into a 256 color RGB palette, as stored in the file
+    std::span<unsigned char> indices;
+    std::span<unsigned char> palette;
     int width;
     int height;
-};
-
-struct Frame
-{
-    std::vector<glm::quat> rotationPerBone;
-    std::vector<glm::vec3> positionPerBone;
+    
+    // STUDIO_NF_* render flags
+    int flags = 0;
+    
+    // Block compressed RGBA with mipmaps, only with ModelLoadOptions::compressTextures
+    std::shared_ptr<const CompressedTexture> compressed;
 };
 
 struct Sequence
 {
     std::string name;
-    std::vector<Frame> frames;
     float fps;
     float groundSpeed;
+    int numFrames;
+    
+    // Decoded poses, [frame][bone] in one block per channel. Empty in
+    // sequence descriptions, the frames are handed out by the cache.
+    int numBones = 0;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::vec3> positions;
+    
+    // With ModelLoadOptions::compressedAnimations the planes stay empty
+    // and poses sample the spans of the file instead
+    CompressedAnimation animation;
+    
+    bool hasFrames() const { return !rotations.empty(); }
+    
+    // Every bone of one frame, consecutive frames are numBones apart
+    std::span<const glm::quat> frameRotations(int frame) const
+    {
+        return { rotations.data() + (size_t)frame * numBones, (size_t)numBones };
+    }
+    
+    std::span<const glm::vec3> framePositions(int frame) const
+    {
+        return { positions.data() + (size_t)frame * numBones, (size_t)numBones };
+    }
 };
 
+class SequenceCache;
+class MappedFile;
+
+// Lets another thread follow a load and abort it
+struct LoadProgress
+{
+    std::atomic<float> value = 0;
+    std::atomic<bool> cancelled = false;
+};
+
+struct ModelLoadOptions
+{
+    // Map the file instead of reading it into a heap buffer
+    bool useMmap = true;
+    
+    // Print header info while loading
+    bool verbose = true;
+    
+    // Decode sequences on first use instead of at load time
+    bool lazySequences = true;
+    
+    // Keep the run length encoded spans of every sequence instead of
+    // expanding its frames. Poses decode only the two frames they blend.
+    bool compressedAnimations = false;
+    
+    // How many lazily decoded sequences stay resident
+    size_t sequenceCacheSize = 8;
+    
+    // Spread textures, meshes and eagerly decoded sequences over the thread pool
+    bool parallel = false;
+    
+    // Optional, receives progress in [0, 1] and is checked for cancellation
+    std::shared_ptr<LoadProgress> progress;
+    
+    // Where decoded models are cached as .mdlc files, empty disables the cache.
+    // A load that writes the cache decodes every sequence for it, even lazily.
+    std::string cacheDirectory;
+    
+    // Bytes the cache directory may hold, the least recently used files
+    // are removed past it after a load writes to it. 0 is unlimited.
+    uint64_t cacheSizeLimit = 0;
+    
+    // Encode every skin to BC1/BC3 for the RGBA renderer. The blocks are
+    // cached next to the models as .bctx files.
+    bool compressTextures = false;
+};
+
+struct MeshData;
+
 struct Model
 {
     std::string name;
     std::vector<Mesh> meshes;
     std::vector<Texture> textures;
-    std::vector<Sequence> sequences;
+    
+    // Every vertex, index, texel and palette buffer of the model. Their
+    // sizes are counted from the file before anything is decoded, so
+    // they take one allocation and are freed in one. Copies of the
+    // model share the block.
+    std::shared_ptr<byte[]> arena;
+    
+    // Texture index of every skinref, one table per skin family
+    std::vector<std::vector<int>> skinFamilies;
+    
     std::vector<int> bones;
     
-    void loadFromFile(const std::string& filename);
+    // Sequence descriptions only, frames are handed out by the cache
+    std::vector<Sequence> sequences;
+    std::shared_ptr<SequenceCache> sequenceCache;
+    
+    bool loadFromFile(const std::string& filename, const ModelLoadOptions& options = {});
+    
+    // A model that is not on disk. It has no files next to it: skins have to
+    // be in the model, sequences of other groups don't decode and it isn't
+    // cached. `data` is copied.
+    bool loadFromMemory(std::span<const byte> data, const ModelLoadOptions& options = {});
     
 private:
-    void readTextures();
-    void readBodyparts();
+    bool load(std::shared_ptr<MappedFile> file, const std::string& filename, const ModelLoadOptions& options);
+
+    std::pair<size_t, size_t> animationRange() const;
+    
+    void forEachIndex(size_t count, float progressFrom, float progressTo, const std::function<void(size_t)>& fn);
+    void setProgress(float value);
+    bool isCancelled() const;
+    std::vector<MeshData> gatherMeshes() const;
+    void allocateArena(const byte* ptexturein, std::vector<MeshData>& meshJobs);
+    void readTextures(const byte* ptexturein);
+    void readSkinFamilies();
+    void readBodyparts(const std::vector<MeshData>& meshJobs);
     void readSequence();
+    void createSequenceCache(std::shared_ptr<const MappedFile> file, const std::string& filename, const ModelLoadOptions& options,
+                             std::shared_ptr<const MappedFile> cacheFile = nullptr);
+    void compressTextures(const std::string& cacheDirectory);
     
-    byte* m_pin;
-    studiohdr_t* m_pheader;
+    std::span<const byte> m_data;
+    const byte* m_pin = nullptr;
+    const studiohdr_t* m_pheader = nullptr;
+    const studiohdr_t* m_ptexturehdr = nullptr;
+    bool m_parallel = false;
+    std::shared_ptr<LoadProgress> m_progress;
 };
+
+// Expands every frame of sequence `index` of a validated model file.
+// `panimdata` is the model itself or the sequence group file holding its animation.
+// With `compressed` the spans are copied into Sequence::animation instead.
+void decodeSequence(const byte* pin, const byte* panimdata, int index, Sequence& seq, bool compressed = false);
+
+// Same naming as the engine: model.mdl keeps its skins in modelT.mdl
+// and the animation of sequence group N in modelNN.mdl
+std::string textureFilename(const std::string& filename);
+std::string sequenceGroupFilename(const std::string& filename, int group);
@@ -0,0 +1,210 @@
+//
+//  MappedFile.cpp
+//  hlmv
+//
+
+#include "MappedFile.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string &filename, bool useMmap)
+{
+    close();
+
+    if (useMmap && map(filename)) {
+        return true;
+    }
+
+    return read(filename);
+}
+
+void MappedFile::assign(std::span<const byte> data)
+{
+    close();
+
+    m_buffer.assign(data.begin(), data.end());
+
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+}
+
+void MappedFile::close()
+{
+    if (m_mapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+        CloseHandle(m_mappingHandle);
+        CloseHandle(m_fileHandle);
+        m_mappingHandle = nullptr;
+        m_fileHandle = nullptr;
+#else
+        munmap((void*)m_data, m_size);
+#endif
+    }
+
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::map(const std::string &filename)
+{
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+    if (mapping == nullptr)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (view == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    m_fileHandle = file;
+    m_mappingHandle = mapping;
+    m_data = (const byte*)view;
+    m_size = (size_t)size.QuadPart;
+    m_mapped = true;
+
+    return true;
+}
+
+void MappedFile::advise(size_t offset, size_t length, Advice advice) const
+{
+    if (!m_mapped || offset >= m_size) return;
+    if (advice != Advice::WillNeed) return;
+
+    if (length > m_size - offset) {
+        length = m_size - offset;
+    }
+
+    WIN32_MEMORY_RANGE_ENTRY range = { (void*)(m_data + offset), length };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+#else
+
+bool MappedFile::map(const std::string &filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+
+    if (addr == MAP_FAILED) return false;
+
+    m_data = (const byte*)addr;
+    m_size = (size_t)st.st_size;
+    m_mapped = true;
+
+    return true;
+}
+
+void MappedFile::advise(size_t offset, size_t length, Advice advice) const
+{
+    if (!m_mapped || offset >= m_size) return;
+
+    if (length > m_size - offset) {
+        length = m_size - offset;
+    }
+
+    // madvise wants a page aligned address
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t aligned = offset - offset % pageSize;
+    length += offset - aligned;
+
+    int flag = MADV_NORMAL;
+
+    switch (advice)
+    {
+        case Advice::Normal: flag = MADV_NORMAL; break;
+        case Advice::Sequential: flag = MADV_SEQUENTIAL; break;
+        case Advice::WillNeed: flag = MADV_WILLNEED; break;
+        case Advice::DontNeed: flag = MADV_DONTNEED; break;
+    }
+
+    madvise((void*)(m_data + aligned), length, flag);
+}
+
+#endif
+
+bool MappedFile::read(const std::string &filename)
+{
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (fp == nullptr) return false;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (size <= 0)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    m_buffer.resize(size);
+    size_t count = fread(m_buffer.data(), size, 1, fp);
+    fclose(fp);
+
+    if (count != 1)
+    {
+        m_buffer.clear();
+        return false;
+    }
+
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+    m_mapped = false;
+
+    return true;
+}
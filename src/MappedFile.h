@@ -0,0 +1,59 @@
+//
+//  MappedFile.h
+//  hlmv
+//
+
+#pragma once
+
+#include <span>
+#include <string>
+#include <vector>
+#include "studio.h"
+
+// Read-only view of a whole file on disk.
+// Uses mmap (MapViewOfFile on Windows) when possible and falls back
+// to reading the file into a heap buffer otherwise. Bytes that are
+// not on disk can be copied into that buffer with assign().
+class MappedFile
+{
+public:
+    enum class Advice
+    {
+        Normal,
+        Sequential,
+        WillNeed,
+        DontNeed
+    };
+
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& filename, bool useMmap = true);
+    void assign(std::span<const byte> data);
+    void close();
+
+    std::span<const byte> data() const { return { m_data, m_size }; }
+    size_t size() const { return m_size; }
+    bool isMapped() const { return m_mapped; }
+
+    // Access pattern hint for a byte range, does nothing for heap-backed files
+    void advise(size_t offset, size_t length, Advice advice) const;
+
+private:
+    bool map(const std::string& filename);
+    bool read(const std::string& filename);
+
+    const byte* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+
+    std::vector<byte> m_buffer;
+
+#ifdef _WIN32
+    void* m_fileHandle = nullptr;
+    void* m_mappingHandle = nullptr;
+#endif
+};
@@ -0,0 +1,151 @@
+//
+//  MeshOptimizer.cpp
+//  hlmv
+//
+
+#include "MeshOptimizer.h"
+#include <algorithm>
+#include <vector>
+
+size_t countCacheMisses(std::span<const unsigned int> indices, size_t vertexCount, int cacheSize)
+{
+    // A vertex is cached while fewer than cacheSize misses happened since it was loaded
+    std::vector<size_t> loadedAt(vertexCount, 0);
+    size_t misses = 0;
+
+    for (unsigned int index : indices)
+    {
+        if (loadedAt[index] == 0 || misses - loadedAt[index] >= (size_t)cacheSize)
+        {
+            misses++;
+            loadedAt[index] = misses;
+        }
+    }
+
+    return misses;
+}
+
+void optimizeVertexCache(std::span<unsigned int> indices, size_t vertexCount, int cacheSize)
+{
+    size_t trianglesCount = indices.size() / 3;
+    if (trianglesCount == 0 || vertexCount == 0) return;
+
+    // Triangles around every vertex, as offsets into one array
+    std::vector<unsigned int> liveTriangles(vertexCount, 0);
+
+    for (size_t i = 0; i < trianglesCount * 3; ++i)
+    {
+        liveTriangles[indices[i]]++;
+    }
+
+    std::vector<size_t> adjacencyOffsets(vertexCount + 1, 0);
+
+    for (size_t v = 0; v < vertexCount; ++v)
+    {
+        adjacencyOffsets[v + 1] = adjacencyOffsets[v] + liveTriangles[v];
+    }
+
+    std::vector<unsigned int> adjacency(trianglesCount * 3);
+    std::vector<size_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+
+    for (size_t i = 0; i < trianglesCount * 3; ++i)
+    {
+        adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+    }
+
+    std::vector<unsigned int> result;
+    result.reserve(trianglesCount * 3);
+
+    std::vector<bool> emitted(trianglesCount, false);
+    std::vector<int> cacheTime(vertexCount, 0);
+    std::vector<unsigned int> deadEnds;
+    std::vector<unsigned int> candidates;
+
+    int time = cacheSize + 1;
+    size_t cursor = 0;
+
+    // Start at the first vertex in use, later ones are found by the cursor
+    long fanning = indices[0];
+
+    while (fanning >= 0)
+    {
+        candidates.clear();
+
+        for (size_t a = adjacencyOffsets[fanning]; a < adjacencyOffsets[fanning + 1]; ++a)
+        {
+            unsigned int t = adjacency[a];
+            if (emitted[t]) continue;
+
+            emitted[t] = true;
+
+            for (int k = 0; k < 3; ++k)
+            {
+                unsigned int v = indices[t * 3 + k];
+                result.push_back(v);
+
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                liveTriangles[v]--;
+
+                if (time - cacheTime[v] > cacheSize)
+                {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        // Prefer the oldest candidate that stays cached while its fan is emitted
+        fanning = -1;
+        int bestPriority = -1;
+
+        for (unsigned int v : candidates)
+        {
+            if (liveTriangles[v] == 0) continue;
+
+            int priority = 0;
+
+            if (time - cacheTime[v] + 2 * (int)liveTriangles[v] <= cacheSize)
+            {
+                priority = time - cacheTime[v];
+            }
+
+            if (priority > bestPriority)
+            {
+                bestPriority = priority;
+                fanning = v;
+            }
+        }
+
+        if (fanning >= 0) continue;
+
+        // Dead end, go back to a recently used vertex or to the next unfinished one
+        while (!deadEnds.empty())
+        {
+            unsigned int v = deadEnds.back();
+            deadEnds.pop_back();
+
+            if (liveTriangles[v] > 0)
+            {
+                fanning = v;
+                break;
+            }
+        }
+
+        if (fanning >= 0) continue;
+
+        for (; cursor < vertexCount; ++cursor)
+        {
+            if (liveTriangles[cursor] > 0)
+            {
+                fanning = cursor;
+                break;
+            }
+        }
+    }
+
+    // Small meshes that fit the cache can come out slightly worse
+    if (countCacheMisses(result, vertexCount, cacheSize) < countCacheMisses(indices, vertexCount, cacheSize))
+    {
+        std::copy(result.begin(), result.end(), indices.begin());
+    }
+}
@@ -0,0 +1,676 @@
+//
+//  ModelCache.cpp
+//  hlmv
+//
+
+#include "ModelCache.h"
+#include "Arena.h"
+#include "MappedFile.h"
+#include "SequenceCache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <filesystem>
+#include <type_traits>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// Buffers are stored in their in-memory layout
+static_assert(std::is_trivially_copyable_v<MeshVertex>);
+static_assert(std::is_trivially_copyable_v<glm::quat>);
+static_assert(std::is_trivially_copyable_v<glm::vec3>);
+
+// All offsets are from the start of the file, every block is 16 byte aligned
+
+struct cachehdr_t
+{
+    int                 id;
+    int                 version;
+    uint64_t            hash;
+
+    int                 length;
+    char                name[64];
+
+    int                 numbones;
+    int                 boneindex;      // int parent per bone
+
+    int                 numtextures;
+    int                 textureindex;
+
+    int                 numskinref;
+    int                 numskinfamilies;
+    int                 skinindex;      // int texture per skinref per family
+
+    int                 nummeshes;
+    int                 meshindex;
+
+    int                 numseq;
+    int                 seqindex;
+};
+
+struct cachetexture_t
+{
+    char                name[64];
+    int                 flags;
+    int                 width;
+    int                 height;
+    int                 index;          // width * height palette indices
+    int                 paletteindex;   // 256 RGB colors
+};
+
+struct cachemesh_t
+{
+    int                 textureindex;
+    int                 skinref;
+    int                 numsourceverts; // strip and fan entries before welding
+    int                 sourcemisses;   // vertex cache misses before reordering
+    int                 numverts;
+    int                 vertindex;      // MeshVertex
+    int                 numindices;
+    int                 indexindex;     // unsigned int
+};
+
+struct cacheseq_t
+{
+    char                label[32];
+    float               fps;
+    float               groundspeed;
+    int                 numframes;
+    int                 rotindex;       // glm::quat per bone per frame, -1 if not cached
+    int                 posindex;       // glm::vec3 per bone per frame, -1 if not cached
+};
+
+static const size_t CACHE_ALIGNMENT = 16;
+
+template<size_t N>
+static void copyName(char (&dst)[N], const std::string& src)
+{
+    memset(dst, 0, N);
+    memcpy(dst, src.data(), src.size() < N ? src.size() : N);
+}
+
+template<size_t N>
+static std::string makeString(const char (&name)[N])
+{
+    return std::string(name, strnlen(name, N));
+}
+
+// FNV-1a over 8 byte words with an extra fold, so high bits reach the low ones
+uint64_t hashBytes(std::span<const byte> data, uint64_t hash)
+{
+    const uint64_t prime = 0x100000001b3ull;
+
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data.data() + i, sizeof(word));
+
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 32;
+    }
+
+    for (; i < data.size(); ++i)
+    {
+        hash = (hash ^ data[i]) * prime;
+    }
+
+    return (hash ^ data.size()) * prime;
+}
+
+uint64_t hashModelFiles(const std::string& filename, std::span<const byte> data)
+{
+    uint64_t hash = hashBytes(data);
+
+    const studiohdr_t* pheader = (const studiohdr_t *)data.data();
+
+    std::vector<std::string> companions;
+
+    if (pheader->textureindex == 0) {
+        companions.push_back(textureFilename(filename));
+    }
+
+    for (int group = 1; group < pheader->numseqgroups; ++group)
+    {
+        companions.push_back(sequenceGroupFilename(filename, group));
+    }
+
+    // A missing file hashes as empty, creating it later is a miss too
+    for (auto& companion : companions)
+    {
+        std::error_code ec;
+
+        uint64_t stamp[2] = { };
+        stamp[0] = std::filesystem::file_size(companion, ec);
+
+        if (!ec) {
+            stamp[1] = std::filesystem::last_write_time(companion, ec).time_since_epoch().count();
+        }
+
+        if (ec) {
+            stamp[0] = stamp[1] = 0;
+        }
+
+        hash = hashBytes({ (const byte *)companion.data(), companion.size() }, hash);
+        hash = hashBytes({ (const byte *)stamp, sizeof(stamp) }, hash);
+    }
+
+    return hash;
+}
+
+std::string modelCachePath(const std::string& directory, uint64_t hash)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mdlc", (unsigned long long)hash);
+
+    return (std::filesystem::path(directory) / name).string();
+}
+
+namespace
+{
+
+// Appends blocks to the file image and hands out their offsets
+class Writer
+{
+public:
+    template<typename T>
+    int put(const T* values, size_t count)
+    {
+        align();
+
+        size_t offset = image.size();
+        image.resize(offset + count * sizeof(T));
+
+        if (count > 0) {
+            memcpy(image.data() + offset, values, count * sizeof(T));
+        }
+
+        return (int)offset;
+    }
+
+    template<typename T>
+    T* at(size_t offset) { return (T*)(image.data() + offset); }
+
+    void align()
+    {
+        image.resize((image.size() + CACHE_ALIGNMENT - 1) & ~(CACHE_ALIGNMENT - 1));
+    }
+
+    std::vector<byte> image;
+};
+
+}
+
+void trimCacheDirectory(const std::string& directory, uint64_t limit)
+{
+    struct Entry
+    {
+        std::filesystem::path path;
+        std::filesystem::file_time_type time;
+        uint64_t size;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    std::error_code ec;
+
+    for (auto it = std::filesystem::directory_iterator(directory, ec); !ec && it != std::filesystem::directory_iterator(); it.increment(ec))
+    {
+        const std::filesystem::path& path = it->path();
+        if (path.extension() != ".mdlc" && path.extension() != ".bctx") continue;
+
+        std::error_code fileError;
+        Entry entry = { path, it->last_write_time(fileError), it->file_size(fileError) };
+        if (fileError) continue;
+
+        entries.push_back(entry);
+        total += entry.size;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.time < b.time;
+    });
+
+    // Files still mapped by another load stay readable until it unmaps them
+    for (auto& entry : entries)
+    {
+        if (total <= limit) break;
+
+        if (std::filesystem::remove(entry.path, ec)) {
+            total -= entry.size;
+        }
+    }
+}
+
+static int processId()
+{
+#ifdef _WIN32
+    return _getpid();
+#else
+    return (int)getpid();
+#endif
+}
+
+bool writeCacheFile(const std::string& path, std::span<const byte> data)
+{
+    std::error_code ec;
+    std::filesystem::path target(path);
+
+    if (target.has_parent_path()) {
+        std::filesystem::create_directories(target.parent_path(), ec);
+    }
+
+    // Loaders running in parallel, in this process or others, may write
+    // the same entry. Each one writes its own file and the last rename wins.
+    static std::atomic<unsigned int> counter = 0;
+
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%d.%zx.%u.tmp", processId(),
+             std::hash<std::thread::id>()(std::this_thread::get_id()), counter++);
+    std::string temppath = path + suffix;
+
+    FILE* fp = fopen(temppath.c_str(), "wb");
+
+    if (fp == nullptr)
+    {
+        printf("unable to write %s\n", temppath.c_str());
+        return false;
+    }
+
+    size_t count = fwrite(data.data(), data.size(), 1, fp);
+
+    if (fclose(fp) != 0 || count != 1)
+    {
+        printf("unable to write %s\n", temppath.c_str());
+        std::filesystem::remove(temppath, ec);
+        return false;
+    }
+
+    std::filesystem::rename(temppath, path, ec);
+
+    if (ec)
+    {
+        printf("unable to write %s: %s\n", path.c_str(), ec.message().c_str());
+        std::filesystem::remove(temppath, ec);
+        return false;
+    }
+
+    return true;
+}
+
+bool writeModelCache(const std::string& path, uint64_t hash, const Model& model)
+{
+    if (model.sequenceCache == nullptr) return false;
+
+    Writer writer;
+
+    cachehdr_t header = { };
+    writer.put(&header, 1);
+
+    header.id = IDMODELCACHEHEADER;
+    header.version = MODELCACHE_VERSION;
+    header.hash = hash;
+    copyName(header.name, model.name);
+
+    header.numbones = (int)model.bones.size();
+    header.boneindex = writer.put(model.bones.data(), model.bones.size());
+
+    // Tables first, their blocks follow
+    std::vector<cachetexture_t> textures(model.textures.size());
+    header.numtextures = (int)textures.size();
+    header.textureindex = writer.put(textures.data(), textures.size());
+
+    // Families are stored one after another
+    std::vector<int> skins;
+
+    for (auto& family : model.skinFamilies)
+    {
+        if (family.size() != model.skinFamilies[0].size()) return false;
+        skins.insert(skins.end(), family.begin(), family.end());
+    }
+
+    header.numskinfamilies = (int)model.skinFamilies.size();
+    header.numskinref = model.skinFamilies.empty() ? 0 : (int)model.skinFamilies[0].size();
+    header.skinindex = writer.put(skins.data(), skins.size());
+
+    std::vector<cachemesh_t> meshes(model.meshes.size());
+    header.nummeshes = (int)meshes.size();
+    header.meshindex = writer.put(meshes.data(), meshes.size());
+
+    std::vector<cacheseq_t> sequences(model.sequences.size());
+    header.numseq = (int)sequences.size();
+    header.seqindex = writer.put(sequences.data(), sequences.size());
+
+    for (size_t i = 0; i < textures.size(); ++i)
+    {
+        const Texture& texture = model.textures[i];
+
+        copyName(textures[i].name, texture.name);
+        textures[i].flags = texture.flags;
+        textures[i].width = texture.width;
+        textures[i].height = texture.height;
+        textures[i].index = writer.put(texture.indices.data(), texture.indices.size());
+        textures[i].paletteindex = writer.put(texture.palette.data(), texture.palette.size());
+    }
+
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        const Mesh& mesh = model.meshes[i];
+
+        meshes[i].textureindex = mesh.textureIndex;
+        meshes[i].skinref = mesh.skinRef;
+        meshes[i].numsourceverts = mesh.sourceVertexCount;
+        meshes[i].sourcemisses = mesh.sourceCacheMisses;
+        meshes[i].numverts = (int)mesh.vertexBuffer.size();
+        meshes[i].vertindex = writer.put(mesh.vertexBuffer.data(), mesh.vertexBuffer.size());
+        meshes[i].numindices = (int)mesh.indexBuffer.size();
+        meshes[i].indexindex = writer.put(mesh.indexBuffer.data(), mesh.indexBuffer.size());
+    }
+
+    for (size_t i = 0; i < sequences.size(); ++i)
+    {
+        const Sequence& desc = model.sequences[i];
+
+        copyName(sequences[i].label, desc.name);
+        sequences[i].fps = desc.fps;
+        sequences[i].groundspeed = desc.groundSpeed;
+        sequences[i].numframes = desc.numFrames;
+        sequences[i].rotindex = -1;
+        sequences[i].posindex = -1;
+
+        // Lazy sequences are decoded for the cache one at a time and dropped
+        // again, compressed ones have no frames and stay with the model
+        std::shared_ptr<const Sequence> sequence = model.sequenceCache->getTransient((int)i);
+        if (sequence == nullptr || !sequence->hasFrames()) continue;
+
+        const Sequence& seq = *sequence;
+
+        // Same [frame][bone] planes as in memory
+        size_t count = (size_t)seq.numFrames * model.bones.size();
+
+        if (seq.numFrames != desc.numFrames || (size_t)seq.numBones != model.bones.size()) return false;
+        if (seq.rotations.size() != count || seq.positions.size() != count) return false;
+
+        sequences[i].rotindex = writer.put(seq.rotations.data(), seq.rotations.size());
+        sequences[i].posindex = writer.put(seq.positions.data(), seq.positions.size());
+    }
+
+    writer.align();
+
+    if (writer.image.size() > INT32_MAX) return false;
+
+    header.length = (int)writer.image.size();
+
+    memcpy(writer.at<cachehdr_t>(0), &header, sizeof(header));
+
+    if (!textures.empty()) memcpy(writer.at<cachetexture_t>(header.textureindex), textures.data(), textures.size() * sizeof(cachetexture_t));
+    if (!meshes.empty()) memcpy(writer.at<cachemesh_t>(header.meshindex), meshes.data(), meshes.size() * sizeof(cachemesh_t));
+    if (!sequences.empty()) memcpy(writer.at<cacheseq_t>(header.seqindex), sequences.data(), sequences.size() * sizeof(cacheseq_t));
+
+    return writeCacheFile(path, writer.image);
+}
+
+// Same rules as the studio model validator: every block in the file and aligned
+static bool inFile(std::span<const byte> data, long long offset, long long count, long long size)
+{
+    if (count < 0) return false;
+    if (count == 0) return true;
+
+    return offset >= 0 && offset % CACHE_ALIGNMENT == 0 && offset + count * size <= (long long)data.size();
+}
+
+static bool validateCache(std::span<const byte> data, uint64_t hash)
+{
+    if (data.size() < sizeof(cachehdr_t)) return false;
+
+    const byte* pin = data.data();
+    const cachehdr_t* pheader = (const cachehdr_t *)pin;
+
+    if (pheader->id != IDMODELCACHEHEADER || pheader->version != MODELCACHE_VERSION) return false;
+    if (pheader->hash != hash || (size_t)pheader->length != data.size()) return false;
+
+    if (pheader->numbones < 0 || pheader->numbones > MAXSTUDIOBONES) return false;
+    if (!inFile(data, pheader->boneindex, pheader->numbones, sizeof(int))) return false;
+    if (!inFile(data, pheader->textureindex, pheader->numtextures, sizeof(cachetexture_t))) return false;
+    if (pheader->numskinref < 0 || pheader->numskinfamilies < 0) return false;
+    if (!inFile(data, pheader->skinindex, (long long)pheader->numskinref * pheader->numskinfamilies, sizeof(int))) return false;
+    if (!inFile(data, pheader->meshindex, pheader->nummeshes, sizeof(cachemesh_t))) return false;
+    if (!inFile(data, pheader->seqindex, pheader->numseq, sizeof(cacheseq_t))) return false;
+
+    // Parents come before their children, poses are built in bone order
+    const int* pbones = (const int *)(pin + pheader->boneindex);
+
+    for (int i = 0; i < pheader->numbones; ++i)
+    {
+        if (pbones[i] < -1 || pbones[i] >= i) return false;
+    }
+
+    const cachetexture_t* ptextures = (const cachetexture_t *)(pin + pheader->textureindex);
+
+    for (int i = 0; i < pheader->numtextures; ++i)
+    {
+        const cachetexture_t& texture = ptextures[i];
+
+        if (texture.width <= 0 || texture.height <= 0 || texture.width > 4096 || texture.height > 4096) return false;
+        if (!inFile(data, texture.index, (long long)texture.width * texture.height, 1)) return false;
+        if (!inFile(data, texture.paletteindex, 256 * 3, 1)) return false;
+    }
+
+    const int* pskins = (const int *)(pin + pheader->skinindex);
+
+    for (long long i = 0; i < (long long)pheader->numskinref * pheader->numskinfamilies; ++i)
+    {
+        if (pskins[i] < 0 || pskins[i] >= pheader->numtextures) return false;
+    }
+
+    const cachemesh_t* pmeshes = (const cachemesh_t *)(pin + pheader->meshindex);
+
+    for (int i = 0; i < pheader->nummeshes; ++i)
+    {
+        const cachemesh_t& mesh = pmeshes[i];
+
+        if (mesh.skinref < -1 || mesh.skinref >= pheader->numskinref) return false;
+        if (mesh.textureindex < -1 || mesh.textureindex >= pheader->numtextures) return false;
+
+        if (!inFile(data, mesh.vertindex, mesh.numverts, sizeof(MeshVertex))) return false;
+        if (!inFile(data, mesh.indexindex, mesh.numindices, sizeof(unsigned int))) return false;
+
+        const MeshVertex* pverts = (const MeshVertex *)(pin + mesh.vertindex);
+
+        for (int j = 0; j < mesh.numverts; ++j)
+        {
+            if (pverts[j].boneIndex < 0 || pverts[j].boneIndex >= pheader->numbones) return false;
+        }
+
+        const unsigned int* pindices = (const unsigned int *)(pin + mesh.indexindex);
+
+        for (int j = 0; j < mesh.numindices; ++j)
+        {
+            if (pindices[j] >= (unsigned int)mesh.numverts) return false;
+        }
+    }
+
+    const cacheseq_t* psequences = (const cacheseq_t *)(pin + pheader->seqindex);
+
+    for (int i = 0; i < pheader->numseq; ++i)
+    {
+        const cacheseq_t& seq = psequences[i];
+        long long count = (long long)seq.numframes * pheader->numbones;
+
+        if (seq.numframes < 0) return false;
+        if (seq.rotindex == -1 && seq.posindex == -1) continue;
+
+        if (!inFile(data, seq.rotindex, count, sizeof(glm::quat))) return false;
+        if (!inFile(data, seq.posindex, count, sizeof(glm::vec3))) return false;
+    }
+
+    return true;
+}
+
+std::shared_ptr<const MappedFile> readModelCache(const std::string& path, uint64_t hash, const ModelLoadOptions& options, Model& model)
+{
+    auto file = std::make_shared<MappedFile>();
+
+    if (!file->open(path, options.useMmap)) return nullptr;
+
+    if (!validateCache(file->data(), hash))
+    {
+        if (options.verbose) printf("ignoring stale cache %s\n", path.c_str());
+        return nullptr;
+    }
+
+    // A hit counts as a use, trimCacheDirectory removes the oldest files first
+    std::error_code ec;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+
+    // Textures and meshes are copied right away, frames only on demand
+    const byte* pin = file->data().data();
+    const cachehdr_t* pheader = (const cachehdr_t *)pin;
+
+    size_t framesBegin = pheader->length;
+
+    const cacheseq_t* psequences = (const cacheseq_t *)(pin + pheader->seqindex);
+
+    for (int i = 0; i < pheader->numseq; ++i)
+    {
+        if (psequences[i].numframes > 0 && psequences[i].rotindex != -1 && (size_t)psequences[i].rotindex < framesBegin) {
+            framesBegin = psequences[i].rotindex;
+        }
+    }
+
+    file->advise(0, framesBegin, MappedFile::Advice::Sequential);
+    file->advise(0, framesBegin, MappedFile::Advice::WillNeed);
+
+    Model result;
+    result.name = makeString(pheader->name);
+
+    const int* pbones = (const int *)(pin + pheader->boneindex);
+    result.bones.assign(pbones, pbones + pheader->numbones);
+
+    const cachetexture_t* ptextures = (const cachetexture_t *)(pin + pheader->textureindex);
+    const cachemesh_t* pmeshes = (const cachemesh_t *)(pin + pheader->meshindex);
+
+    // Every size is in the tables, the buffers go to one block
+    Arena layout;
+
+    for (int i = 0; i < pheader->numtextures; ++i)
+    {
+        layout.reserve<unsigned char>(ptextures[i].width * ptextures[i].height);
+        layout.reserve<unsigned char>(256 * 3);
+    }
+
+    for (int i = 0; i < pheader->nummeshes; ++i)
+    {
+        layout.reserve<MeshVertex>(pmeshes[i].numverts);
+        layout.reserve<unsigned int>(pmeshes[i].numindices);
+    }
+
+    result.arena = layout.allocate();
+    result.textures.resize(pheader->numtextures);
+
+    for (int i = 0; i < pheader->numtextures; ++i)
+    {
+        const cachetexture_t& src = ptextures[i];
+        Texture& texture = result.textures[i];
+
+        const byte* pindices = pin + src.index;
+        const byte* ppalette = pin + src.paletteindex;
+
+        texture.name = makeString(src.name);
+        texture.flags = src.flags;
+        texture.width = src.width;
+        texture.height = src.height;
+        texture.indices = layout.take<unsigned char>(src.width * src.height);
+        texture.palette = layout.take<unsigned char>(256 * 3);
+
+        memcpy(texture.indices.data(), pindices, texture.indices.size());
+        memcpy(texture.palette.data(), ppalette, texture.palette.size());
+    }
+
+    const int* pskins = (const int *)(pin + pheader->skinindex);
+
+    for (int i = 0; i < pheader->numskinfamilies; ++i)
+    {
+        const int* family = pskins + i * pheader->numskinref;
+        result.skinFamilies.emplace_back(family, family + pheader->numskinref);
+    }
+
+    result.meshes.resize(pheader->nummeshes);
+
+    for (int i = 0; i < pheader->nummeshes; ++i)
+    {
+        const cachemesh_t& src = pmeshes[i];
+        Mesh& mesh = result.meshes[i];
+
+        const MeshVertex* pverts = (const MeshVertex *)(pin + src.vertindex);
+        const unsigned int* pindices = (const unsigned int *)(pin + src.indexindex);
+
+        mesh.textureIndex = src.textureindex;
+        mesh.skinRef = src.skinref;
+        mesh.sourceVertexCount = src.numsourceverts;
+        mesh.sourceCacheMisses = src.sourcemisses;
+        mesh.vertexBuffer = layout.take<MeshVertex>(src.numverts);
+        mesh.indexBuffer = layout.take<unsigned int>(src.numindices);
+
+        memcpy(mesh.vertexBuffer.data(), pverts, mesh.vertexBuffer.size_bytes());
+        memcpy(mesh.indexBuffer.data(), pindices, mesh.indexBuffer.size_bytes());
+    }
+
+    for (int i = 0; i < pheader->numseq; ++i)
+    {
+        Sequence seq;
+        seq.name = makeString(psequences[i].label);
+        seq.fps = psequences[i].fps;
+        seq.groundSpeed = psequences[i].groundspeed;
+        seq.numFrames = psequences[i].numframes;
+
+        result.sequences.push_back(seq);
+    }
+
+    model.name = std::move(result.name);
+    model.arena = std::move(result.arena);
+    model.meshes = std::move(result.meshes);
+    model.textures = std::move(result.textures);
+    model.skinFamilies = std::move(result.skinFamilies);
+    model.bones = std::move(result.bones);
+    model.sequences = std::move(result.sequences);
+
+    return file;
+}
+
+bool hasCachedSequence(std::span<const byte> data, int index)
+{
+    const byte* pin = data.data();
+    const cachehdr_t* pheader = (const cachehdr_t *)pin;
+
+    return ((const cacheseq_t *)(pin + pheader->seqindex))[index].rotindex != -1;
+}
+
+void readCachedSequence(std::span<const byte> data, int index, Sequence& seq)
+{
+    const byte* pin = data.data();
+    const cachehdr_t* pheader = (const cachehdr_t *)pin;
+    const cacheseq_t& sequence = ((const cacheseq_t *)(pin + pheader->seqindex))[index];
+
+    size_t numbones = pheader->numbones;
+
+    const glm::quat* protations = (const glm::quat *)(pin + sequence.rotindex);
+    const glm::vec3* ppositions = (const glm::vec3 *)(pin + sequence.posindex);
+
+    seq.name = makeString(sequence.label);
+    seq.fps = sequence.fps;
+    seq.groundSpeed = sequence.groundspeed;
+    seq.numFrames = sequence.numframes;
+    seq.numBones = (int)numbones;
+    seq.rotations.assign(protations, protations + sequence.numframes * numbones);
+    seq.positions.assign(ppositions, ppositions + sequence.numframes * numbones);
+}
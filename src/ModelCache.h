@@ -0,0 +1,64 @@
+//
+//  ModelCache.h
+//  hlmv
+//
+
+#pragma once
+
+#include <span>
+#include <string>
+#include <stdint.h>
+
+#include "GoldSrcModel.h"
+
+// A decoded model is stored as one flat .mdlc file: indexed textures,
+// vertex and index buffers and the expanded frames of every sequence,
+// each in a single block that is copied out of the mapping as is.
+// Nothing in it is decoded again, a warm load costs page faults and
+// copies. Sequences without frames in the file, those of compressed
+// loads, are decoded from the model as usual.
+//
+// The file is named after a hash of the source files and also records
+// MODELCACHE_VERSION. Changing either makes the old entry a miss, so the
+// version has to be bumped whenever the layout or the decoded data changes.
+
+#define IDMODELCACHEHEADER (('C'<<24)+('L'<<16)+('D'<<8)+'M') // little-endian "MDLC"
+#define MODELCACHE_VERSION 8
+
+class MappedFile;
+
+// FNV-1a, the same hash names every cache file
+uint64_t hashBytes(std::span<const byte> data, uint64_t hash = 0xcbf29ce484222325ull);
+
+// Hash of the model and of the path, size and modification time of the
+// modelT.mdl and modelNN.mdl files it uses. Those are never read here,
+// a warm load touches only the model and the cache file.
+uint64_t hashModelFiles(const std::string& filename, std::span<const byte> data);
+
+std::string modelCachePath(const std::string& directory, uint64_t hash);
+
+// Fills `model` from a cache file, except for its sequence cache. Returns
+// the mapped file, which holds the cached frames, or null and leaves
+// `model` alone when the file is missing, stale or damaged.
+std::shared_ptr<const MappedFile> readModelCache(const std::string& path, uint64_t hash, const ModelLoadOptions& options, Model& model);
+
+// Writes the cache file of a loaded model. Sequences its cache doesn't hold
+// are decoded for it one at a time and dropped again, so the ones in use
+// stay resident and later loads decode none.
+// The file appears under its final name only once it is complete.
+bool writeModelCache(const std::string& path, uint64_t hash, const Model& model);
+
+// Removes .mdlc and .bctx files from `directory`, oldest modification time
+// first, until the rest fits in `limit` bytes. readModelCache refreshes the
+// time of every hit, so the least recently used models go first.
+void trimCacheDirectory(const std::string& directory, uint64_t limit);
+
+// Writes `data` to a temporary file next to `path` and renames it into place,
+// creating the directory if needed
+bool writeCacheFile(const std::string& path, std::span<const byte> data);
+
+// True if a cache file read by readModelCache holds the frames of sequence `index`
+bool hasCachedSequence(std::span<const byte> data, int index);
+
+// Copies the frames of sequence `index` out of a cache file read by readModelCache
+void readCachedSequence(std::span<const byte> data, int index, Sequence& seq);
@@ -0,0 +1,331 @@
+//
+//  ModelIndex.cpp
+//  hlmv
+//
+
+#include "ModelIndex.h"
+#include "GoldSrcModel.h"
+#include "MappedFile.h"
+#include "ModelValidator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <filesystem>
+
+#define MODELINDEX_HEADER "# hlmv model index 1"
+
+// Names in the file are fixed size and not always null terminated
+template<size_t N>
+static std::string makeString(const char (&name)[N])
+{
+    return std::string(name, strnlen(name, N));
+}
+
+static int countTriangles(const byte* pin, const mstudiomesh_t& mesh)
+{
+    const int16_t* ptricmds = (const int16_t *)(pin + mesh.triindex);
+    int triangles = 0;
+
+    // Strips and fans of n vertices both make n - 2 triangles
+    while (int count = abs(*ptricmds))
+    {
+        triangles += count - 2;
+        ptricmds += 1 + count * 4;
+    }
+
+    return triangles;
+}
+
+bool summarizeModel(const std::string& filename, ModelSummary& summary, bool useMmap)
+{
+    MappedFile file;
+
+    if (!file.open(filename, useMmap))
+    {
+        printf("unable to open %s\n", filename.c_str());
+        return false;
+    }
+
+    std::string error;
+
+    if (!validateModel(file.data(), error))
+    {
+        printf("%s is not a valid studio model: %s\n", filename.c_str(), error.c_str());
+        return false;
+    }
+
+    const byte* pin = file.data().data();
+    const studiohdr_t* pheader = (const studiohdr_t *)pin;
+
+    summary.name = makeString(pheader->name);
+    summary.numBones = pheader->numbones;
+    summary.mins = { pheader->bbmin[0], pheader->bbmin[1], pheader->bbmin[2] };
+    summary.maxs = { pheader->bbmax[0], pheader->bbmax[1], pheader->bbmax[2] };
+
+    const mstudioseqdesc_t* psequences = (const mstudioseqdesc_t *)(pin + pheader->seqindex);
+    summary.sequences.clear();
+
+    for (int i = 0; i < pheader->numseq; ++i)
+    {
+        summary.sequences.push_back({ makeString(psequences[i].label), psequences[i].numframes });
+    }
+
+    summary.numVertices = 0;
+    summary.numTriangles = 0;
+
+    const mstudiobodyparts_t* pbodyparts = (const mstudiobodyparts_t *)(pin + pheader->bodypartindex);
+
+    for (int i = 0; i < pheader->numbodyparts; ++i)
+    {
+        const mstudiomodel_t* pmodels = (const mstudiomodel_t *)(pin + pbodyparts[i].modelindex);
+
+        for (int j = 0; j < pbodyparts[i].nummodels; ++j)
+        {
+            summary.numVertices += pmodels[j].numverts;
+
+            const mstudiomesh_t* pmeshes = (const mstudiomesh_t *)(pin + pmodels[j].meshindex);
+
+            for (int k = 0; k < pmodels[j].nummesh; ++k)
+            {
+                summary.numTriangles += countTriangles(pin, pmeshes[k]);
+            }
+        }
+    }
+
+    MappedFile textureFile;
+    const byte* ptexturein = pin;
+
+    if (pheader->textureindex == 0)
+    {
+        std::string texturename = textureFilename(filename);
+        ptexturein = nullptr;
+
+        if (!textureFile.open(texturename, useMmap)) {
+            printf("unable to open %s\n", texturename.c_str());
+        }
+        else if (!validateModel(textureFile.data(), error)) {
+            printf("%s is not a valid texture file: %s\n", texturename.c_str(), error.c_str());
+        }
+        else {
+            ptexturein = textureFile.data().data();
+        }
+    }
+
+    summary.textures.clear();
+
+    if (ptexturein != nullptr)
+    {
+        const studiohdr_t* ptexturehdr = (const studiohdr_t *)ptexturein;
+
+        // A T-file that has its textures elsewhere again has none
+        const mstudiotexture_t* ptextures = (const mstudiotexture_t *)(ptexturein + ptexturehdr->textureindex);
+        int count = ptexturehdr->textureindex != 0 ? ptexturehdr->numtextures : 0;
+
+        for (int i = 0; i < count; ++i)
+        {
+            summary.textures.push_back({ ptextures[i].width, ptextures[i].height });
+        }
+    }
+
+    return true;
+}
+
+// Keeps the separators of the line format out of names
+static std::string escape(const std::string& name)
+{
+    if (name.empty()) return "-";
+
+    std::string result = name;
+
+    for (char& c : result)
+    {
+        if (c == '\t' || c == '\n' || c == '\r' || c == ',' || c == ':') c = '_';
+    }
+
+    return result;
+}
+
+static std::vector<std::string> split(const std::string& line, char separator, size_t maxFields)
+{
+    std::vector<std::string> fields;
+    size_t begin = 0;
+
+    while (fields.size() + 1 < maxFields)
+    {
+        size_t end = line.find(separator, begin);
+        if (end == std::string::npos) break;
+
+        fields.push_back(line.substr(begin, end - begin));
+        begin = end + 1;
+    }
+
+    fields.push_back(line.substr(begin));
+    return fields;
+}
+
+static bool readLine(FILE* fp, std::string& line)
+{
+    line.clear();
+
+    char buffer[4096];
+
+    while (fgets(buffer, sizeof(buffer), fp))
+    {
+        line += buffer;
+
+        if (!line.empty() && line.back() == '\n')
+        {
+            line.pop_back();
+            return true;
+        }
+    }
+
+    return !line.empty();
+}
+
+static bool parseSummary(const std::string& line, ModelSummary& summary)
+{
+    const size_t FIELDS = 15;
+
+    std::vector<std::string> fields = split(line, '\t', FIELDS);
+    if (fields.size() != FIELDS) return false;
+
+    summary.size = strtoull(fields[0].c_str(), nullptr, 10);
+    summary.mtime = strtoll(fields[1].c_str(), nullptr, 10);
+    summary.numBones = atoi(fields[2].c_str());
+    summary.numVertices = atoi(fields[3].c_str());
+    summary.numTriangles = atoi(fields[4].c_str());
+
+    for (int i = 0; i < 3; ++i)
+    {
+        summary.mins[i] = strtof(fields[5 + i].c_str(), nullptr);
+        summary.maxs[i] = strtof(fields[8 + i].c_str(), nullptr);
+    }
+
+    summary.name = fields[11] == "-" ? "" : fields[11];
+    summary.path = fields[14];
+
+    summary.textures.clear();
+
+    if (fields[12] != "-")
+    {
+        for (auto& texture : split(fields[12], ',', SIZE_MAX))
+        {
+            TextureSummary size = { };
+            if (sscanf(texture.c_str(), "%dx%d", &size.width, &size.height) != 2) return false;
+
+            summary.textures.push_back(size);
+        }
+    }
+
+    summary.sequences.clear();
+
+    if (fields[13] != "-")
+    {
+        for (auto& sequence : split(fields[13], ',', SIZE_MAX))
+        {
+            size_t colon = sequence.rfind(':');
+            if (colon == std::string::npos) return false;
+
+            summary.sequences.push_back({ sequence.substr(0, colon), atoi(sequence.c_str() + colon + 1) });
+        }
+    }
+
+    return !summary.path.empty();
+}
+
+bool readModelIndex(const std::string& filename, std::vector<ModelSummary>& models)
+{
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (fp == nullptr) return false;
+
+    std::string line;
+
+    // An index of another version is rebuilt from scratch
+    if (!readLine(fp, line) || line != MODELINDEX_HEADER)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    models.clear();
+
+    while (readLine(fp, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+
+        ModelSummary summary;
+
+        if (!parseSummary(line, summary))
+        {
+            fclose(fp);
+            models.clear();
+            return false;
+        }
+
+        models.push_back(std::move(summary));
+    }
+
+    fclose(fp);
+    return true;
+}
+
+bool writeModelIndex(const std::string& filename, const std::vector<ModelSummary>& models)
+{
+    // Replace the old index only once the new one is complete
+    std::string temppath = filename + ".tmp";
+
+    FILE* fp = fopen(temppath.c_str(), "wb");
+
+    if (fp == nullptr)
+    {
+        printf("unable to write %s\n", temppath.c_str());
+        return false;
+    }
+
+    fprintf(fp, "%s\n", MODELINDEX_HEADER);
+    fprintf(fp, "# size\tmtime\tbones\tvertices\ttriangles\tmins\t\t\tmaxs\t\t\tname\ttextures\tsequences\tpath\n");
+
+    for (auto& model : models)
+    {
+        fprintf(fp, "%llu\t%lld\t%i\t%i\t%i\t%g\t%g\t%g\t%g\t%g\t%g\t%s\t",
+                (unsigned long long)model.size, (long long)model.mtime,
+                model.numBones, model.numVertices, model.numTriangles,
+                model.mins.x, model.mins.y, model.mins.z,
+                model.maxs.x, model.maxs.y, model.maxs.z,
+                escape(model.name).c_str());
+
+        for (size_t i = 0; i < model.textures.size(); ++i)
+        {
+            fprintf(fp, "%s%ix%i", i > 0 ? "," : "", model.textures[i].width, model.textures[i].height);
+        }
+
+        fprintf(fp, "%s\t", model.textures.empty() ? "-" : "");
+
+        for (size_t i = 0; i < model.sequences.size(); ++i)
+        {
+            fprintf(fp, "%s%s:%i", i > 0 ? "," : "", escape(model.sequences[i].name).c_str(), model.sequences[i].numFrames);
+        }
+
+        fprintf(fp, "%s\t%s\n", model.sequences.empty() ? "-" : "", model.path.c_str());
+    }
+
+    if (fclose(fp) != 0)
+    {
+        printf("unable to write %s\n", temppath.c_str());
+        return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temppath, filename, ec);
+
+    if (ec)
+    {
+        printf("unable to write %s: %s\n", filename.c_str(), ec.message().c_str());
+        return false;
+    }
+
+    return true;
+}
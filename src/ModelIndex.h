@@ -0,0 +1,55 @@
+//
+//  ModelIndex.h
+//  hlmv
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+
+struct TextureSummary
+{
+    int width;
+    int height;
+};
+
+struct SequenceSummary
+{
+    std::string name;
+    int numFrames;
+};
+
+// What the index keeps about a model, read from the headers without
+// decoding textures, meshes or animation
+struct ModelSummary
+{
+    // Source file, unchanged size and mtime mean the entry is still valid
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+
+    std::string name;
+    int numBones = 0;
+
+    // Unique studio vertices, before they are unrolled per triangle command
+    int numVertices = 0;
+    int numTriangles = 0;
+    glm::vec3 mins = glm::vec3(0);
+    glm::vec3 maxs = glm::vec3(0);
+    std::vector<TextureSummary> textures;
+    std::vector<SequenceSummary> sequences;
+};
+
+// Fills everything but path, size and mtime. Textures come from modelT.mdl
+// when the model keeps them there.
+bool summarizeModel(const std::string& filename, ModelSummary& summary, bool useMmap = true);
+
+// The index is a text file with one tab separated line per model, so it can
+// be queried with the usual text tools:
+//   size mtime bones vertices triangles mins(3) maxs(3) name textures sequences path
+// Textures are "WxH,WxH,...", sequences "name:frames,...", "-" means none.
+bool readModelIndex(const std::string& filename, std::vector<ModelSummary>& models);
+bool writeModelIndex(const std::string& filename, const std::vector<ModelSummary>& models);
@@ -0,0 +1,393 @@
+//
+//  ModelValidator.cpp
+//  hlmv
+//
+
+#include "ModelValidator.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+namespace
+{
+
+class Validator
+{
+public:
+    Validator(std::span<const byte> data, std::string& error) : data(data), error(error) { }
+
+    bool run();
+    bool runGroup(const studiohdr_t* pmodel, int index);
+
+private:
+    bool header();
+    bool bones();
+    bool sequences();
+    bool groupHeader();
+    bool sequenceAnimation(const mstudioseqdesc_t& seq);
+    bool animation(const mstudioseqdesc_t& seq, const mstudioanim_t* panim, int channel);
+    bool textures();
+    bool bodyparts();
+    bool model(const mstudiomodel_t& model);
+    bool triangles(const mstudiomesh_t& mesh, const mstudiomodel_t& model);
+
+    // Is [offset, offset + count * size) inside the file and naturally aligned
+    bool range(long long offset, long long count, long long size, const char* what);
+    bool fail(const char* format, ...);
+
+    template<typename T>
+    const T* at(long long offset) const { return (const T*)(data.data() + offset); }
+
+    std::span<const byte> data;
+    std::string& error;
+
+    const studiohdr_t* pheader = nullptr;
+};
+
+bool Validator::run()
+{
+    return header() && bones() && sequences() && textures() && bodyparts();
+}
+
+// The group file only holds animation values, all descriptions
+// come from the model header
+bool Validator::runGroup(const studiohdr_t* pmodel, int index)
+{
+    pheader = pmodel;
+
+    if (!groupHeader()) return false;
+
+    const mstudioseqdesc_t* psequences = (const mstudioseqdesc_t *)((const byte *)pmodel + pmodel->seqindex);
+
+    for (int i = 0; i < pheader->numseq; ++i)
+    {
+        if (psequences[i].seqgroup != index) continue;
+        if (!sequenceAnimation(psequences[i])) return false;
+    }
+
+    return true;
+}
+
+bool Validator::header()
+{
+    if (data.size() < sizeof(studiohdr_t)) {
+        return fail("file is too small for a studio header");
+    }
+
+    pheader = at<studiohdr_t>(0);
+
+    if (pheader->id != IDSTUDIOHEADER) {
+        return fail("bad magic");
+    }
+
+    if (pheader->version != STUDIO_VERSION) {
+        return fail("unsupported version %i", pheader->version);
+    }
+
+    if (pheader->length < (int)sizeof(studiohdr_t) || (size_t)pheader->length > data.size()) {
+        return fail("header length %i does not match file size %zu", pheader->length, data.size());
+    }
+
+    if (pheader->numbones < 0 || pheader->numbones > MAXSTUDIOBONES) {
+        return fail("bad bone count %i", pheader->numbones);
+    }
+
+    return true;
+}
+
+bool Validator::bones()
+{
+    if (!range(pheader->boneindex, pheader->numbones, sizeof(mstudiobone_t), "bones")) return false;
+
+    const mstudiobone_t* pbones = at<mstudiobone_t>(pheader->boneindex);
+
+    // Pose evaluation walks bones in order and expects parents first
+    for (int i = 0; i < pheader->numbones; ++i)
+    {
+        int parent = pbones[i].parent;
+
+        if (parent < -1 || parent >= i) {
+            return fail("bone %i has bad parent %i", i, parent);
+        }
+    }
+
+    return true;
+}
+
+bool Validator::sequences()
+{
+    if (!range(pheader->seqindex, pheader->numseq, sizeof(mstudioseqdesc_t), "sequences")) return false;
+    if (!range(pheader->seqgroupindex, pheader->numseqgroups, sizeof(mstudioseqgroup_t), "sequence groups")) return false;
+
+    const mstudioseqdesc_t* psequences = at<mstudioseqdesc_t>(pheader->seqindex);
+
+    for (int i = 0; i < pheader->numseq; ++i)
+    {
+        const mstudioseqdesc_t& seq = psequences[i];
+
+        if (seq.numframes < 1) {
+            return fail("sequence %i has no frames", i);
+        }
+
+        if (seq.numblends < 1) {
+            return fail("sequence %i has no blends", i);
+        }
+
+        if (seq.seqgroup < 0 || (seq.seqgroup > 0 && seq.seqgroup >= pheader->numseqgroups)) {
+            return fail("sequence %i has bad group %i", i, seq.seqgroup);
+        }
+
+        // Animation of other groups lives in external files
+        if (seq.seqgroup != 0) continue;
+
+        if (!sequenceAnimation(seq)) return false;
+    }
+
+    return true;
+}
+
+bool Validator::groupHeader()
+{
+    if (data.size() < sizeof(studioseqhdr_t)) {
+        return fail("file is too small for a sequence group header");
+    }
+
+    const studioseqhdr_t* pseqheader = at<studioseqhdr_t>(0);
+
+    if (pseqheader->id != IDSTUDIOSEQHEADER) {
+        return fail("bad magic");
+    }
+
+    if (pseqheader->version != STUDIO_VERSION) {
+        return fail("unsupported version %i", pseqheader->version);
+    }
+
+    return true;
+}
+
+bool Validator::sequenceAnimation(const mstudioseqdesc_t& seq)
+{
+    long long count = (long long)seq.numblends * pheader->numbones;
+    if (!range(seq.animindex, count, sizeof(mstudioanim_t), "animation")) return false;
+
+    const mstudioanim_t* panim = at<mstudioanim_t>(seq.animindex);
+
+    for (int j = 0; j < count; ++j)
+    {
+        for (int channel = 0; channel < 6; ++channel)
+        {
+            if (!animation(seq, &panim[j], channel)) return false;
+        }
+    }
+
+    return true;
+}
+
+// Walks the run length encoded values of one channel the same way the
+// decoders do and makes sure every span needed for numframes is in the file
+bool Validator::animation(const mstudioseqdesc_t& seq, const mstudioanim_t* panim, int channel)
+{
+    if (panim->offset[channel] == 0) return true;
+
+    long long offset = ((const byte*)panim - data.data()) + panim->offset[channel];
+    int frames = 0;
+
+    while (frames < seq.numframes)
+    {
+        if (!range(offset, 1, sizeof(mstudioanimvalue_t), "animation values")) return false;
+
+        const mstudioanimvalue_t* panimvalue = at<mstudioanimvalue_t>(offset);
+
+        if (panimvalue->num.total == 0) {
+            return fail("empty animation span in sequence %.32s", seq.label);
+        }
+
+        if (!range(offset, panimvalue->num.valid + 1, sizeof(mstudioanimvalue_t), "animation values")) return false;
+
+        frames += panimvalue->num.total;
+        offset += (panimvalue->num.valid + 1) * sizeof(mstudioanimvalue_t);
+    }
+
+    return true;
+}
+
+bool Validator::textures()
+{
+    if (pheader->numskinref < 0 || pheader->numskinfamilies < 0) {
+        return fail("bad skin table size");
+    }
+
+    long long count = (long long)pheader->numskinref * pheader->numskinfamilies;
+    if (!range(pheader->skinindex, count, sizeof(int16_t), "skin table")) return false;
+
+    // Textures are stored in a separate file
+    if (pheader->textureindex == 0) return true;
+
+    if (!range(pheader->textureindex, pheader->numtextures, sizeof(mstudiotexture_t), "textures")) return false;
+
+    const mstudiotexture_t* ptextures = at<mstudiotexture_t>(pheader->textureindex);
+
+    for (int i = 0; i < pheader->numtextures; ++i)
+    {
+        const mstudiotexture_t& texture = ptextures[i];
+
+        if (texture.width <= 0 || texture.height <= 0 || texture.width > 4096 || texture.height > 4096) {
+            return fail("texture %i has bad size %ix%i", i, texture.width, texture.height);
+        }
+
+        // 8-bit indices followed by a 256 color RGB palette
+        long long size = (long long)texture.width * texture.height + 256 * 3;
+        if (!range(texture.index, size, 1, "texture data")) return false;
+    }
+
+    const int16_t* skinrefs = at<int16_t>(pheader->skinindex);
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (skinrefs[i] < 0 || skinrefs[i] >= pheader->numtextures) {
+            return fail("skin table references missing texture %i", skinrefs[i]);
+        }
+    }
+
+    return true;
+}
+
+bool Validator::bodyparts()
+{
+    if (!range(pheader->bodypartindex, pheader->numbodyparts, sizeof(mstudiobodyparts_t), "bodyparts")) return false;
+
+    const mstudiobodyparts_t* pbodyparts = at<mstudiobodyparts_t>(pheader->bodypartindex);
+
+    for (int i = 0; i < pheader->numbodyparts; ++i)
+    {
+        const mstudiobodyparts_t& bodypart = pbodyparts[i];
+
+        if (!range(bodypart.modelindex, bodypart.nummodels, sizeof(mstudiomodel_t), "models")) return false;
+
+        const mstudiomodel_t* pmodels = at<mstudiomodel_t>(bodypart.modelindex);
+
+        for (int j = 0; j < bodypart.nummodels; ++j)
+        {
+            if (!model(pmodels[j])) return false;
+        }
+    }
+
+    return true;
+}
+
+bool Validator::model(const mstudiomodel_t& model)
+{
+    if (!range(model.vertindex, model.numverts, sizeof(vec3_t), "vertices")) return false;
+    if (!range(model.normindex, model.numnorms, sizeof(vec3_t), "normals")) return false;
+    if (!range(model.vertinfoindex, model.numverts, sizeof(byte), "vertex bones")) return false;
+    if (!range(model.meshindex, model.nummesh, sizeof(mstudiomesh_t), "meshes")) return false;
+
+    const byte* pvertinfo = at<byte>(model.vertinfoindex);
+
+    for (int i = 0; i < model.numverts; ++i)
+    {
+        if (pvertinfo[i] >= pheader->numbones) {
+            return fail("vertex %i of %.64s is bound to missing bone %i", i, model.name, pvertinfo[i]);
+        }
+    }
+
+    const mstudiomesh_t* pmeshes = at<mstudiomesh_t>(model.meshindex);
+
+    for (int i = 0; i < model.nummesh; ++i)
+    {
+        if (pmeshes[i].skinref < 0) {
+            return fail("mesh %i of %.64s has bad skinref %i", i, model.name, pmeshes[i].skinref);
+        }
+
+        if (!triangles(pmeshes[i], model)) return false;
+    }
+
+    return true;
+}
+
+// Triangle commands: a signed strip/fan length followed by that many
+// (vertex, normal, s, t) tuples, terminated by a zero length
+bool Validator::triangles(const mstudiomesh_t& mesh, const mstudiomodel_t& model)
+{
+    long long offset = mesh.triindex;
+
+    while (true)
+    {
+        if (!range(offset, 1, sizeof(int16_t), "triangle commands")) return false;
+
+        int count = abs(*at<int16_t>(offset));
+        offset += sizeof(int16_t);
+
+        if (count == 0) break;
+
+        if (count < 3) {
+            return fail("degenerate triangle strip in %.64s", model.name);
+        }
+
+        if (!range(offset, count * 4, sizeof(int16_t), "triangle commands")) return false;
+
+        const int16_t* ptricmds = at<int16_t>(offset);
+
+        for (int i = 0; i < count; ++i, ptricmds += 4)
+        {
+            if (ptricmds[0] < 0 || ptricmds[0] >= model.numverts) {
+                return fail("triangle references missing vertex %i in %.64s", ptricmds[0], model.name);
+            }
+
+            if (ptricmds[1] < 0 || ptricmds[1] >= model.numnorms) {
+                return fail("triangle references missing normal %i in %.64s", ptricmds[1], model.name);
+            }
+        }
+
+        offset += count * 4 * sizeof(int16_t);
+    }
+
+    return true;
+}
+
+bool Validator::range(long long offset, long long count, long long size, const char* what)
+{
+    if (count < 0) {
+        return fail("negative %s count %lli", what, count);
+    }
+
+    if (count == 0) return true;
+
+    if (offset < 0 || offset + count * size > (long long)data.size()) {
+        return fail("%s at offset %lli are outside of the file", what, offset);
+    }
+
+    // studiomdl aligns every table, the decoders read them in place
+    long long alignment = size < 4 ? size : 4;
+
+    if (offset % alignment != 0) {
+        return fail("%s at offset %lli are misaligned", what, offset);
+    }
+
+    return true;
+}
+
+bool Validator::fail(const char* format, ...)
+{
+    char message[256];
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    error = message;
+    return false;
+}
+
+}
+
+bool validateModel(std::span<const byte> data, std::string& error)
+{
+    return Validator(data, error).run();
+}
+
+bool validateSequenceGroup(std::span<const byte> model, std::span<const byte> group, int index, std::string& error)
+{
+    return Validator(group, error).runGroup((const studiohdr_t *)model.data(), index);
+}
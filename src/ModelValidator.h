@@ -0,0 +1,19 @@
+//
+//  ModelValidator.h
+//  hlmv
+//
+
+#pragma once
+
+#include <span>
+#include <string>
+#include "studio.h"
+
+// Checks every offset, count and index table of a studio model against
+// the size of the file in a single pass. Once it succeeded the decoders
+// can dereference the file without any bounds checks of their own.
+bool validateModel(std::span<const byte> data, std::string& error);
+
+// Checks a demand loaded sequence group file (modelNN.mdl) against the
+// sequences of an already validated model that reference group `index`
+bool validateSequenceGroup(std::span<const byte> model, std::span<const byte> group, int index, std::string& error);
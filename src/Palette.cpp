@@ -0,0 +1,144 @@
+//
+//  Palette.cpp
+//  hlmv
+//
+
+#include "Palette.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PALETTE_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC compiles intrinsics for any instruction set without extra flags
+#if defined(PALETTE_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+// RGB entries widened to little-endian RGBA words, one load per pixel
+static void buildTable(const byte* palette, uint32_t* table)
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        const byte* color = palette + i * 3;
+        table[i] = color[0] | (color[1] << 8) | (color[2] << 16) | 0xff000000u;
+    }
+}
+
+static void expandScalar(const byte* indices, const uint32_t* table, size_t count, byte* rgba)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t pixel = table[indices[i]];
+        memcpy(rgba + i * 4, &pixel, sizeof(pixel));
+    }
+}
+
+#ifdef PALETTE_X86
+
+TARGET_AVX2
+static void expandAVX2(const byte* indices, const uint32_t* table, size_t count, byte* rgba)
+{
+    size_t i = 0;
+
+    // Two independent gathers per iteration hide part of their latency
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i packed = _mm_loadu_si128((const __m128i *)(indices + i));
+
+        __m256i low = _mm256_cvtepu8_epi32(packed);
+        __m256i high = _mm256_cvtepu8_epi32(_mm_srli_si128(packed, 8));
+
+        __m256i pixelsLow = _mm256_i32gather_epi32((const int *)table, low, 4);
+        __m256i pixelsHigh = _mm256_i32gather_epi32((const int *)table, high, 4);
+
+        _mm256_storeu_si256((__m256i *)(rgba + i * 4), pixelsLow);
+        _mm256_storeu_si256((__m256i *)(rgba + i * 4 + 32), pixelsHigh);
+    }
+
+    expandScalar(indices + i, table, count - i, rgba + i * 4);
+}
+
+static bool cpuHasAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+
+    __cpuid(info, 1);
+
+    // The OS has to save the YMM registers too
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 6) != 6) return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+bool isSupported(PaletteKernel kernel)
+{
+    switch (kernel)
+    {
+        case PaletteKernel::Scalar:
+            return true;
+
+        case PaletteKernel::AVX2:
+#ifdef PALETTE_X86
+        {
+            static const bool supported = cpuHasAVX2();
+            return supported;
+        }
+#else
+            return false;
+#endif
+    }
+
+    return false;
+}
+
+const char* kernelName(PaletteKernel kernel)
+{
+    switch (kernel)
+    {
+        case PaletteKernel::Scalar: return "scalar";
+        case PaletteKernel::AVX2: return "avx2";
+    }
+
+    return "unknown";
+}
+
+void expandPalette(const byte* indices, const byte* palette, size_t count, byte* rgba)
+{
+    static const PaletteKernel best = isSupported(PaletteKernel::AVX2) ? PaletteKernel::AVX2 : PaletteKernel::Scalar;
+
+    expandPalette(indices, palette, count, rgba, best);
+}
+
+void expandPalette(const byte* indices, const byte* palette, size_t count, byte* rgba, PaletteKernel kernel)
+{
+    uint32_t table[256];
+    buildTable(palette, table);
+
+#ifdef PALETTE_X86
+    if (kernel == PaletteKernel::AVX2 && isSupported(kernel))
+    {
+        expandAVX2(indices, table, count, rgba);
+        return;
+    }
+#endif
+
+    expandScalar(indices, table, count, rgba);
+}
@@ -0,0 +1,29 @@
+//
+//  Palette.h
+//  hlmv
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "studio.h"
+
+// Ways to expand 8-bit palette indices. Every kernel gives the same result,
+// they only exist side by side so they can be compared.
+enum class PaletteKernel
+{
+    // One 32-bit table load per pixel
+    Scalar,
+
+    // Eight pixels per gather from the same table
+    AVX2
+};
+
+bool isSupported(PaletteKernel kernel);
+const char* kernelName(PaletteKernel kernel);
+
+// Expands `count` indices into RGBA pixels with alpha 255, using the
+// fastest kernel the CPU supports. `palette` holds 256 RGB entries.
+void expandPalette(const byte* indices, const byte* palette, size_t count, byte* rgba);
+void expandPalette(const byte* indices, const byte* palette, size_t count, byte* rgba, PaletteKernel kernel);
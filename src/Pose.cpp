@@ -0,0 +1,86 @@
+//
+//  Pose.cpp
+//  hlmv
+//
+
+#include "Pose.h"
+#include <math.h>
+
+#define GLM_ENABLE_EXPERIMENTAL 1
+#include <glm/gtx/quaternion.hpp>
+
+void calcBoneTransforms(const Sequence& seq, const std::vector<int>& bones, float frame, std::vector<glm::mat4>& transforms)
+{
+    if (!seq.hasFrames() && seq.animation.empty()) return;
+    if ((size_t)seq.numBones != bones.size() || bones.size() > MAXSTUDIOBONES) return;
+    
+    transforms.resize(bones.size());
+    
+    int currIndex = int(frame) % seq.numFrames;
+    int nextIndex = (currIndex + 1) % seq.numFrames;
+    
+    float factor = frame - floor(frame);
+    
+    std::span<const glm::quat> currRotations, nextRotations;
+    std::span<const glm::vec3> currPositions, nextPositions;
+    
+    glm::quat sampledRotations[2][MAXSTUDIOBONES];
+    glm::vec3 sampledPositions[2][MAXSTUDIOBONES];
+    
+    if (seq.hasFrames())
+    {
+        // Both frames are contiguous rows of the sequence
+        currRotations = seq.frameRotations(currIndex);
+        nextRotations = seq.frameRotations(nextIndex);
+        currPositions = seq.framePositions(currIndex);
+        nextPositions = seq.framePositions(nextIndex);
+    }
+    else
+    {
+        // Only the two blended frames are decoded from the spans
+        float channels[MAXSTUDIOBONES * ANIM_CHANNELS];
+        int indices[2] = { currIndex, nextIndex };
+        
+        for (int k = 0; k < 2; ++k)
+        {
+            sampleAnimation(seq.animation, indices[k], channels);
+            
+            for (size_t i = 0; i < bones.size(); ++i)
+            {
+                const float* values = channels + i * ANIM_CHANNELS;
+                sampledPositions[k][i] = { values[0], values[1], values[2] };
+            }
+            
+            eulerToQuaternions(channels + 3, ANIM_CHANNELS, bones.size(), sampledRotations[k]);
+        }
+        
+        currRotations = { sampledRotations[0], bones.size() };
+        nextRotations = { sampledRotations[1], bones.size() };
+        currPositions = { sampledPositions[0], bones.size() };
+        nextPositions = { sampledPositions[1], bones.size() };
+    }
+    
+    for (size_t i = 0; i < bones.size(); ++i)
+    {
+        const glm::quat& currRotation = currRotations[i];
+        const glm::quat& nextRotation = nextRotations[i];
+        
+        const glm::vec3& currPosition = currPositions[i];
+        const glm::vec3& nextPosition = nextPositions[i];
+        
+        glm::quat rotation = currRotation * (1.0f - factor) + nextRotation * factor;
+        glm::vec3 position = currPosition * (1.0f - factor) + nextPosition * factor;
+        
+        glm::mat4& transform = transforms[i];
+        transform = glm::toMat4(rotation);
+        
+        transform[3][0] = position[0];
+        transform[3][1] = position[1];
+        transform[3][2] = position[2];
+        
+        if (bones[i] != -1)
+        {
+            transform = transforms[bones[i]] * transform;
+        }
+    }
+}
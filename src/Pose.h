@@ -0,0 +1,14 @@
+//
+//  Pose.h
+//  hlmv
+//
+
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "GoldSrcModel.h"
+
+// Blends the two frames around `frame` and concatenates parent transforms,
+// so every matrix in `transforms` ends up in model space
+void calcBoneTransforms(const Sequence& seq, const std::vector<int>& bones, float frame, std::vector<glm::mat4>& transforms);
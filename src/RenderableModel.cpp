@@ -6,10 +6,16 @@
 //
 
 #include "RenderableModel.h"
+#include "Palette.h"
+#include "Pose.h"
+#include "SequenceCache.h"
+#include "TextureCompression.h"
+#include "ModelCache.h"
 #include <glad/glad.h>
-
-#define GLM_ENABLE_EXPERIMENTAL 1
-#include <glm/gtx/quaternion.hpp>
+#include <glm/gtc/packing.hpp>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
 
 //#pragma warning( disable : 4244 ) // conversion from 'double ' to 'float ', possible loss of data
 //#pragma warning( disable : 4305 ) // truncation from 'const double ' to 'float '
@@ -18,46 +24,359 @@ RenderableModel::~RenderableModel()
 {
     printf("Delete %s", name.c_str());
     
-    glDeleteTextures(textures.size(), textures.data());
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
     glDeleteBuffers(1, &ibo);
 }
 
-void RenderableModel::init(const Model &model)
+// EXT_texture_compression_s3tc is not core GL 4.1 and not in the glad build,
+// but every desktop driver has it
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+
+static bool supportsS3TC()
+{
+    static const bool supported = []() {
+        
+        int count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        
+        for (int i = 0; i < count; ++i)
+        {
+            const char* name = (const char *)glGetStringi(GL_EXTENSIONS, i);
+            if (name && strcmp(name, "GL_EXT_texture_compression_s3tc") == 0) return true;
+        }
+        
+        return false;
+    }();
+    
+    return supported;
+}
+
+// The mip chain comes precomputed with the blocks
+static void uploadCompressed(const CompressedTexture& texture)
 {
+    GLenum format = texture.format == BlockFormat::BC1 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    
+    for (int i = 0; i < (int)texture.levels.size(); ++i)
+    {
+        const CompressedLevel& level = texture.levels[i];
+        glCompressedTexImage2D(GL_TEXTURE_2D, i, format, level.width, level.height, 0, (GLsizei)level.data.size(), level.data.data());
+    }
+    
+    bool mipmaps = texture.levels.size() > 1;
+    
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (int)texture.levels.size() - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+void RenderableModel::init(const Model &model, TextureMode textureMode, bool packTextures, VertexFormat vertexFormat)
+{
+    this->textureMode = textureMode;
+    this->vertexFormat = vertexFormat;
     this->name = model.name;
     this->sequences = model.sequences;
     this->bones = model.bones;
+    this->sequenceCache = model.sequenceCache;
     
     transforms.resize(bones.size());
     
-    uploadTextures(model.textures);
-    uploadMeshes(model.meshes);
+    setSeqIndex(0);
+    
+    textureSizes.clear();
+    textureFlags.clear();
+    
+    for (auto& texture : model.textures)
+    {
+        textureSizes.push_back({ texture.width, texture.height });
+        textureFlags.push_back(texture.flags);
+    }
+    
+    int maxLayers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    
+    // Blocks can't be resampled into a shared layer size
+    bool compressed = textureMode == TextureMode::RGBA && supportsS3TC() && std::any_of(model.textures.begin(), model.textures.end(), [](const Texture& texture) {
+        return texture.compressed != nullptr;
+    });
+    
+    std::vector<uint64_t> hashes;
+    
+    for (auto& texture : model.textures) {
+        hashes.push_back(hashTexture(texture));
+    }
+    
+    if (packTextures && !compressed && !model.textures.empty() && (int)model.textures.size() <= maxLayers) {
+        uploadTextureArray(model.textures, hashes);
+    }
+    else {
+        uploadTextures(model.textures, hashes);
+    }
+    
+    uploadMeshes(model.meshes, model.textures);
+    
+    skinFamilies = model.skinFamilies;
+    skinFamily = 0;
+    
+    updateSkins();
 }
 
-void RenderableModel::uploadTextures(const std::vector<Texture> &textures)
+// The same skin uploaded another way is another texture
+enum class UploadKind
 {
-    this->textures.resize(textures.size());
+    Indexed,
+    RGBA,
+    Compressed,
+    IndexedArray,
+    RGBAArray
+};
+
+static uint64_t registryKey(uint64_t hash, UploadKind kind)
+{
+    int value = (int)kind;
+    return hashBytes({ (const byte *)&value, sizeof(value) }, hash);
+}
+
+// Bilinear, wrapping around the edges like GL_REPEAT
+static void resample(const byte* src, int width, int height, byte* dst, int dstWidth, int dstHeight)
+{
+    for (int y = 0; y < dstHeight; ++y)
+    {
+        float sy = (y + 0.5f) * height / dstHeight - 0.5f;
+        int y0 = (int)floorf(sy);
+        float fy = sy - y0;
+        
+        int row0 = ((y0 % height + height) % height) * width;
+        int row1 = (((y0 + 1) % height + height) % height) * width;
+        
+        for (int x = 0; x < dstWidth; ++x)
+        {
+            float sx = (x + 0.5f) * width / dstWidth - 0.5f;
+            int x0 = (int)floorf(sx);
+            float fx = sx - x0;
+            
+            int col0 = (x0 % width + width) % width;
+            int col1 = ((x0 + 1) % width + width) % width;
+            
+            for (int c = 0; c < 4; ++c)
+            {
+                float top = src[(row0 + col0) * 4 + c] * (1 - fx) + src[(row0 + col1) * 4 + c] * fx;
+                float bottom = src[(row1 + col0) * 4 + c] * (1 - fx) + src[(row1 + col1) * 4 + c] * fx;
+                
+                dst[(y * dstWidth + x) * 4 + c] = (byte)(top * (1 - fy) + bottom * fy + 0.5f);
+            }
+        }
+    }
+}
+
+static void uploadArray(const std::vector<const Texture*> &textures, TextureMode textureMode, SharedTexture& shared)
+{
+    int width = 0;
+    int height = 0;
     
-    for (int i = 0; i < textures.size(); ++i)
+    for (const Texture* item : textures)
     {
-        const Texture& item = textures[i];
+        width = std::max(width, item->width);
+        height = std::max(height, item->height);
+    }
+    
+    int layers = (int) textures.size();
+    
+    glGenTextures(1, &shared.texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shared.texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    
+    if (textureMode == TextureMode::Indexed)
+    {
+        // The shader wraps inside the skin's own size, the padding is never read
+        std::vector<byte> padding(width * height);
+        
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8, width, height, layers, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+        
+        std::vector<byte> palettes(layers * 256 * 3);
+        
+        for (int i = 0; i < layers; ++i)
+        {
+            const Texture& item = *textures[i];
+            
+            if (item.width < width || item.height < height) {
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, width, height, 1, GL_RED, GL_UNSIGNED_BYTE, padding.data());
+            }
+            
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, item.width, item.height, 1, GL_RED, GL_UNSIGNED_BYTE, item.indices.data());
+            
+            std::copy(item.palette.begin(), item.palette.end(), palettes.begin() + i * 256 * 3);
+        }
         
-        unsigned int id;
-        glGenTextures(1, &id);
-        glBindTexture(GL_TEXTURE_2D, id);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glGenTextures(1, &shared.palette);
+        glBindTexture(GL_TEXTURE_2D, shared.palette);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 256, layers, 0, GL_RGB, GL_UNSIGNED_BYTE, palettes.data());
+    }
+    else
+    {
+        // Mipmaps are built for every layer, STUDIO_NF_NOMIPS skins sample level 0
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, width, height, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        
+        std::vector<byte> resampled(width * height * 4);
+        
+        for (int i = 0; i < layers; ++i)
+        {
+            const Texture& item = *textures[i];
+            std::vector<byte> rgba = expandTexture(item);
+            
+            // Padding would bleed into the filtered edges, so smaller skins
+            // are stretched, by less than twice within a bucket
+            if (item.width != width || item.height != height)
+            {
+                resample(rgba.data(), item.width, item.height, resampled.data(), width, height);
+                rgba.swap(resampled);
+                resampled.resize(width * height * 4);
+            }
+            
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+        }
+        
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    }
+    
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+static void uploadTexture(const Texture& item, UploadKind kind, SharedTexture& shared)
+{
+    glGenTextures(1, &shared.texture);
+    glBindTexture(GL_TEXTURE_2D, shared.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    
+    // Rows of 8-bit indices and RGB palettes are not 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    
+    if (kind == UploadKind::Indexed)
+    {
+        // Indices can't be blended, the shader filters after the lookup
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, item.width, item.height, 0, GL_RED, GL_UNSIGNED_BYTE, item.indices.data());
+        
+        glGenTextures(1, &shared.palette);
+        glBindTexture(GL_TEXTURE_2D, shared.palette);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 256, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, item.palette.data());
+    }
+    else if (kind == UploadKind::Compressed)
+    {
+        uploadCompressed(*item.compressed);
+    }
+    else
+    {
+        std::vector<byte> rgba = expandTexture(item);
+        
+        bool mipmaps = (item.flags & STUDIO_NF_NOMIPS) == 0;
+        
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
         glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, item.width, item.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+        
+        if (mipmaps) {
+            glGenerateMipmap(GL_TEXTURE_2D);
+        }
+    }
+    
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+// Smallest power of two not below `size`
+static int bucketSize(int size)
+{
+    int bucket = 1;
+    
+    while (bucket < size) {
+        bucket *= 2;
+    }
+    
+    return bucket;
+}
+
+// Skins are grouped by their size rounded up to powers of two, so a layer
+// is never more than twice as wide or high as the skin in it
+void RenderableModel::uploadTextureArray(const std::vector<Texture> &textures, const std::vector<uint64_t>& hashes)
+{
+    std::vector<glm::ivec2> bucketSizes;
+    std::vector<std::vector<const Texture*>> buckets;
+    std::vector<std::vector<uint64_t>> bucketHashes;
+    
+    textureBuckets.resize(textures.size());
+    textureLayers.resize(textures.size());
+    
+    for (size_t i = 0; i < textures.size(); ++i)
+    {
+        glm::ivec2 size(bucketSize(textures[i].width), bucketSize(textures[i].height));
+        
+        auto it = std::find(bucketSizes.begin(), bucketSizes.end(), size);
+        int bucket = (int)(it - bucketSizes.begin());
+        
+        if (it == bucketSizes.end())
+        {
+            bucketSizes.push_back(size);
+            buckets.emplace_back();
+            bucketHashes.emplace_back();
+        }
+        
+        textureBuckets[i] = bucket;
+        textureLayers[i] = (int)buckets[bucket].size();
+        buckets[bucket].push_back(&textures[i]);
+        bucketHashes[bucket].push_back(hashes[i]);
+    }
+    
+    // An array is keyed by the skins of its bucket only, so models share
+    // every bucket whose skins and their order match. Sharing stays coarser
+    // than with single textures: a bucket that differs in one skin is
+    // uploaded again as a whole.
+    UploadKind kind = textureMode == TextureMode::Indexed ? UploadKind::IndexedArray : UploadKind::RGBAArray;
+    
+    textureArrays.clear();
+    
+    for (size_t i = 0; i < buckets.size(); ++i)
+    {
+        const std::vector<const Texture*>& items = buckets[i];
+        const std::vector<uint64_t>& itemHashes = bucketHashes[i];
+        uint64_t key = registryKey(hashBytes({ (const byte *)itemHashes.data(), itemHashes.size() * sizeof(uint64_t) }), kind);
         
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, item.width, item.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, item.data.data());
-        glGenerateMipmap(GL_TEXTURE_2D);
+        textureArrays.push_back(TextureRegistry::instance().acquire(key, [&items, this](SharedTexture& shared) {
+            uploadArray(items, textureMode, shared);
+        }));
+    }
+}
+
+void RenderableModel::uploadTextures(const std::vector<Texture> &textures, const std::vector<uint64_t>& hashes)
+{
+    this->textures.resize(textures.size());
+    
+    for (size_t i = 0; i < textures.size(); ++i)
+    {
+        const Texture& item = textures[i];
         
-        this->textures[i] = id;
+        UploadKind kind = UploadKind::Indexed;
         
-//        stbi_write_png(item.name.c_str(), item.width, item.height, 4, item.data.data(), item.width * 4);
+        if (textureMode == TextureMode::RGBA) {
+            kind = item.compressed && supportsS3TC() ? UploadKind::Compressed : UploadKind::RGBA;
+        }
+        
+        this->textures[i] = TextureRegistry::instance().acquire(registryKey(hashes[i], kind), [&item, kind](SharedTexture& shared) {
+            uploadTexture(item, kind, shared);
+        });
     }
 }
 
@@ -66,46 +385,190 @@ void RenderableModel::uploadTextures(const std::vector<Texture> &textures)
 #define VERT_DIFFUSE_TEX_COORD_LOC 2
 #define VERT_BONE_INDEX_LOC 3
 
-void RenderableModel::uploadMeshes(const std::vector<Mesh> &meshes)
+struct CompactVertex
+{
+    int16_t position[3];
+    uint8_t boneIndex;
+    uint8_t padding;
+    int16_t normal[2];
+    uint16_t texCoord[2];
+};
+
+static_assert(sizeof(CompactVertex) == 16);
+
+static float signNotZero(float value)
+{
+    return value >= 0 ? 1.0f : -1.0f;
+}
+
+// Unit vector folded onto the octahedron |x| + |y| + |z| = 1, whose lower
+// half is unfolded over the corners of the xy square
+static glm::vec2 octahedralEncode(glm::vec3 normal)
+{
+    float sum = fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z);
+    if (sum == 0) return glm::vec2(0);
+    
+    glm::vec2 p = glm::vec2(normal) / sum;
+    
+    if (normal.z < 0)
+    {
+        p = (1.0f - glm::abs(glm::vec2(p.y, p.x))) * glm::vec2(signNotZero(p.x), signNotZero(p.y));
+    }
+    
+    return p;
+}
+
+static int16_t quantize(float value)
+{
+    return (int16_t)glm::clamp(roundf(value * 32767.0f), -32767.0f, 32767.0f);
+}
+
+// Positions become shorts relative to the center of the model bounds,
+// `scale` and `offset` turn them back into model space
+static std::vector<CompactVertex> compactVertices(const std::vector<MeshVertex>& vertices, glm::vec3& scale, glm::vec3& offset)
+{
+    glm::vec3 mins(0);
+    glm::vec3 maxs(0);
+    
+    if (!vertices.empty())
+    {
+        mins = maxs = vertices[0].position;
+    }
+    
+    for (auto& vertex : vertices)
+    {
+        mins = glm::min(mins, vertex.position);
+        maxs = glm::max(maxs, vertex.position);
+    }
+    
+    glm::vec3 extents = glm::max((maxs - mins) * 0.5f, glm::vec3(1e-6f));
+    
+    offset = (mins + maxs) * 0.5f;
+    scale = extents / 32767.0f;
+    
+    std::vector<CompactVertex> result(vertices.size());
+    
+    for (size_t i = 0; i < vertices.size(); ++i)
+    {
+        const MeshVertex& src = vertices[i];
+        CompactVertex& dst = result[i];
+        
+        glm::vec3 position = (src.position - offset) / extents;
+        glm::vec2 normal = octahedralEncode(src.normal);
+        
+        dst.position[0] = quantize(position.x);
+        dst.position[1] = quantize(position.y);
+        dst.position[2] = quantize(position.z);
+        dst.boneIndex = (uint8_t)src.boneIndex;
+        dst.padding = 0;
+        dst.normal[0] = quantize(normal.x);
+        dst.normal[1] = quantize(normal.y);
+        
+        uint32_t texCoord = glm::packHalf2x16(src.texCoord);
+        dst.texCoord[0] = texCoord & 0xffff;
+        dst.texCoord[1] = texCoord >> 16;
+    }
+    
+    return result;
+}
+
+static RenderPass renderPass(int flags)
+{
+    if (flags & STUDIO_NF_ADDITIVE) return RenderPass::Additive;
+    if (flags & STUDIO_NF_MASKED) return RenderPass::Masked;
+    
+    return RenderPass::Opaque;
+}
+
+void RenderableModel::uploadMeshes(const std::vector<Mesh> &meshes, const std::vector<Texture> &textures)
 {
     std::vector<MeshVertex> vertices;
     std::vector<unsigned int> indices;
     
-    for (auto& mesh : meshes)
+    auto flags = [&textures](const Mesh& mesh) {
+        bool textured = mesh.textureIndex >= 0 && mesh.textureIndex < (int)textures.size();
+        return textured ? textures[mesh.textureIndex].flags : 0;
+    };
+    
+    // Meshes are laid out by pass and then by skinref, so all meshes with
+    // the same skin are one range of the index buffer and one draw call.
+    // Only the order within a pass changes, and that is covered by the
+    // depth test or by additive blending.
+    std::vector<const Mesh*> order;
+    
+    for (auto& mesh : meshes) {
+        order.push_back(&mesh);
+    }
+    
+    std::stable_sort(order.begin(), order.end(), [&flags](const Mesh* a, const Mesh* b) {
+        RenderPass passA = renderPass(flags(*a));
+        RenderPass passB = renderPass(flags(*b));
+        
+        if (passA != passB) return passA < passB;
+        if (a->skinRef != b->skinRef) return a->skinRef < b->skinRef;
+        
+        return a->textureIndex < b->textureIndex;
+    });
+    
+    for (const Mesh* mesh : order)
     {
-        RenderableSurface& surface = surfaces.emplace_back();
-        surface.tex = mesh.textureIndex;
-        surface.bufferOffset = (int) indices.size() * sizeof(unsigned int);
-        surface.indicesCount = (int) mesh.indexBuffer.size();
+        if (surfaces.empty() || surfaces.back().skinRef != mesh->skinRef || surfaces.back().baseTex != mesh->textureIndex)
+        {
+            RenderableSurface& surface = surfaces.emplace_back();
+            surface.skinRef = mesh->skinRef;
+            surface.baseTex = mesh->textureIndex;
+            surface.bufferOffset = (int) indices.size() * sizeof(unsigned int);
+            surface.indicesCount = 0;
+        }
+        
+        surfaces.back().indicesCount += (int) mesh->indexBuffer.size();
         
         int indicesOffset = (int) vertices.size();
         
-        for (int i = 0; i < mesh.indexBuffer.size(); ++i)
+        for (int i = 0; i < mesh->indexBuffer.size(); ++i)
         {
-            indices.push_back(indicesOffset + mesh.indexBuffer[i]);
+            indices.push_back(indicesOffset + mesh->indexBuffer[i]);
         }
         
-        vertices.insert(vertices.end(), mesh.vertexBuffer.begin(), mesh.vertexBuffer.end());
+        vertices.insert(vertices.end(), mesh->vertexBuffer.begin(), mesh->vertexBuffer.end());
     }
     
     glGenBuffers(1, &vbo);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
     
     glGenVertexArrays(1, &vao);
     glBindVertexArray(vao);
     
     glEnableVertexAttribArray(VERT_POSITION_LOC);
-    glVertexAttribPointer(VERT_POSITION_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, position));
-    
     glEnableVertexAttribArray(VERT_NORMAL_LOC);
-    glVertexAttribPointer(VERT_NORMAL_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, normal));
-
     glEnableVertexAttribArray(VERT_DIFFUSE_TEX_COORD_LOC);
-    glVertexAttribPointer(VERT_DIFFUSE_TEX_COORD_LOC, 2, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, texCoord));
-    
     glEnableVertexAttribArray(VERT_BONE_INDEX_LOC);
-    glVertexAttribIPointer(VERT_BONE_INDEX_LOC, 1, GL_INT, sizeof(MeshVertex), (void*)offsetof(MeshVertex, boneIndex));
+    
+    if (vertexFormat == VertexFormat::Compact)
+    {
+        std::vector<CompactVertex> compact = compactVertices(vertices, positionScale, positionOffset);
+        
+        glBufferData(GL_ARRAY_BUFFER, sizeof(CompactVertex) * compact.size(), compact.data(), GL_STATIC_DRAW);
+        
+        // Plain integers, the shader scales them. Normalized shorts are
+        // converted differently before GL 4.2.
+        glVertexAttribPointer(VERT_POSITION_LOC, 3, GL_SHORT, GL_FALSE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, position));
+        glVertexAttribPointer(VERT_NORMAL_LOC, 2, GL_SHORT, GL_FALSE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, normal));
+        glVertexAttribPointer(VERT_DIFFUSE_TEX_COORD_LOC, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, texCoord));
+        glVertexAttribIPointer(VERT_BONE_INDEX_LOC, 1, GL_UNSIGNED_BYTE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, boneIndex));
+    }
+    else
+    {
+        positionScale = glm::vec3(1);
+        positionOffset = glm::vec3(0);
+        
+        glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+        
+        glVertexAttribPointer(VERT_POSITION_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, position));
+        glVertexAttribPointer(VERT_NORMAL_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, normal));
+        glVertexAttribPointer(VERT_DIFFUSE_TEX_COORD_LOC, 2, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, texCoord));
+        glVertexAttribIPointer(VERT_BONE_INDEX_LOC, 1, GL_INT, sizeof(MeshVertex), (void*)offsetof(MeshVertex, boneIndex));
+    }
     
     glGenBuffers(1, &ibo);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
@@ -114,48 +577,20 @@ void RenderableModel::uploadMeshes(const std::vector<Mesh> &meshes)
 
 void RenderableModel::updatePose()
 {
-    Sequence& seq = sequences[cur_seq_index];
-    
-    int currIndex = int(cur_frame);
-    int nextIndex = (currIndex + 1) % seq.frames.size();
-    
-    float factor = cur_frame - floor(cur_frame);
-    
-    Frame& curr = seq.frames[currIndex];
-    Frame& next = seq.frames[nextIndex];
-    
-    for (int i = 0; i < bones.size(); ++i)
-    {
-        glm::quat& currRotation = curr.rotationPerBone[i];
-        glm::quat& nextRotation = next.rotationPerBone[i];
-        
-        glm::vec3& currPosition = curr.positionPerBone[i];
-        glm::vec3& nextPosition = next.positionPerBone[i];
-        
-        glm::quat rotation = currRotation * (1.0f - factor) + nextRotation * factor;
-        glm::vec3 position = currPosition * (1.0f - factor) + nextPosition * factor;
-        
-        glm::mat4& transform = transforms[i];
-        transform = glm::toMat4(rotation);
-        
-        transform[3][0] = position[0];
-        transform[3][1] = position[1];
-        transform[3][2] = position[2];
-        
-        if (bones[i] != -1)
-        {
-            transform = transforms[bones[i]] * transform;
-        }
-    }
+    calcBoneTransforms(*cur_sequence, bones, cur_frame, transforms);
 }
 
 void RenderableModel::update(float dt)
 {
-    if (cur_seq_index >= sequences.size()) return;
+    if (pending_seq_index != -1) {
+        setSeqIndex(pending_seq_index);
+    }
+    
+    if (cur_sequence == nullptr) return;
     
-    Sequence& seq = sequences[cur_seq_index];
+    const Sequence& seq = *cur_sequence;
     
-    cur_anim_duration = (float)seq.frames.size() / seq.fps;
+    cur_anim_duration = (float)seq.numFrames / seq.fps;
     
     updatePose();
     
@@ -166,29 +601,164 @@ void RenderableModel::update(float dt)
         cur_frame_time = 0;
     }
     
-    cur_frame = (float)seq.frames.size() * (cur_frame_time / cur_anim_duration);
+    cur_frame = (float)seq.numFrames * (cur_frame_time / cur_anim_duration);
+}
+
+static void setRenderPass(RenderPass pass)
+{
+    switch (pass)
+    {
+        case RenderPass::Opaque:
+        case RenderPass::Masked:
+            glDisable(GL_BLEND);
+            glDepthMask(GL_TRUE);
+            break;
+            
+        case RenderPass::Additive:
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+            glDepthMask(GL_FALSE);
+            break;
+    }
 }
 
-void RenderableModel::draw()
+void RenderableModel::draw(const SurfaceUniforms& uniforms)
 {
     glBindVertexArray(vao);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
     
+    bool packed = !textureArrays.empty();
+    
+    // Arrays are only rebound between surfaces of different buckets
+    const SharedTexture* boundArray = nullptr;
+    
+    RenderPass pass = RenderPass::Opaque;
+    setRenderPass(pass);
+    
     for (auto& surface : surfaces)
     {
-        unsigned int texId = textures[surface.tex];
+        if (surface.pass != pass)
+        {
+            pass = surface.pass;
+            setRenderPass(pass);
+        }
+        
+        if (packed)
+        {
+            const SharedTexture* array = surface.tex >= 0 ? textureArrays[textureBuckets[surface.tex]].get() : nullptr;
+            
+            if (array != nullptr && array != boundArray)
+            {
+                boundArray = array;
+                
+                glActiveTexture(GL_TEXTURE2);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, array->texture);
+                
+                if (textureMode == TextureMode::Indexed)
+                {
+                    glActiveTexture(GL_TEXTURE1);
+                    glBindTexture(GL_TEXTURE_2D, array->palette);
+                }
+            }
+        }
+        else
+        {
+            const SharedTexture* texture = surface.tex >= 0 && surface.tex < (int)textures.size() ? textures[surface.tex].get() : nullptr;
+            
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, texture ? texture->texture : 0);
+            
+            if (textureMode == TextureMode::Indexed)
+            {
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, texture ? texture->palette : 0);
+            }
+        }
+        
+        glm::ivec2 size = surface.tex >= 0 ? textureSizes[surface.tex] : glm::ivec2(1);
+        int layer = packed && surface.tex >= 0 ? textureLayers[surface.tex] : -1;
         
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texId);
+        glUniform1i(uniforms.flags, surface.flags);
+        glUniform1i(uniforms.layer, layer);
+        glUniform2i(uniforms.textureSize, size.x, size.y);
+        glUniform2f(uniforms.texCoordScale, surface.texCoordScale.x, surface.texCoordScale.y);
         
         glDrawElements(GL_TRIANGLES, surface.indicesCount, GL_UNSIGNED_INT, (void*)surface.bufferOffset);
     }
+    
+    setRenderPass(RenderPass::Opaque);
+}
+
+// Only the texture of each surface changes, buffers and uploaded textures stay
+void RenderableModel::setSkinFamily(int family)
+{
+    if (family < 0 || family >= (int)skinFamilies.size() || family == skinFamily) return;
+    
+    skinFamily = family;
+    updateSkins();
+}
+
+int RenderableModel::getSkinFamily() const
+{
+    return skinFamily;
+}
+
+int RenderableModel::getSkinFamilyCount() const
+{
+    return (int)skinFamilies.size();
+}
+
+void RenderableModel::updateSkins()
+{
+    const std::vector<int>* family = skinFamily < (int)skinFamilies.size() ? &skinFamilies[skinFamily] : nullptr;
+    
+    for (auto& surface : surfaces)
+    {
+        int tex = surface.baseTex;
+        
+        if (family != nullptr && surface.skinRef >= 0 && surface.skinRef < (int)family->size()) {
+            tex = (*family)[surface.skinRef];
+        }
+        
+        bool textured = tex >= 0 && tex < (int)textureSizes.size();
+        bool baseTextured = surface.baseTex >= 0 && surface.baseTex < (int)textureSizes.size();
+        
+        surface.tex = textured ? tex : -1;
+        surface.flags = textured ? textureFlags[tex] : 0;
+        surface.pass = renderPass(surface.flags);
+        
+        // Texture coordinates were divided by the size of the family 0 skin,
+        // the engine uses the size of the current one
+        surface.texCoordScale = glm::vec2(1);
+        
+        if (textured && baseTextured) {
+            surface.texCoordScale = glm::vec2(textureSizes[surface.baseTex]) / glm::vec2(textureSizes[tex]);
+        }
+    }
+    
+    // Another family may put a skin into another pass
+    std::stable_sort(surfaces.begin(), surfaces.end(), [](const RenderableSurface& a, const RenderableSurface& b) {
+        return a.pass < b.pass;
+    });
 }
 
 void RenderableModel::setSeqIndex(int index)
 {
     if (index >= sequences.size()) return;
     
+    // The first selection decodes the sequence
+    auto sequence = sequenceCache ? sequenceCache->get(index) : nullptr;
+    
+    if (sequence == nullptr)
+    {
+        // Keep playing the current one until the group file is read
+        bool loading = sequenceCache && sequenceCache->isLoading(index);
+        pending_seq_index = loading ? index : -1;
+        return;
+    }
+    
+    pending_seq_index = -1;
+    cur_sequence = sequence;
     cur_seq_index = index;
     cur_frame_time = 0;
     cur_frame = 0;
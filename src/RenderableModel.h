@@ -10,10 +10,70 @@
 #include <vector>
 #include <glm/glm.hpp>
 #include "GoldSrcModel.h"
+#include "TextureRegistry.h"
 
+// How skins are stored on the GPU
+enum class TextureMode
+{
+    // Expanded to RGBA with mipmaps
+    RGBA,
+    
+    // R8 index plane plus a 256x1 palette, looked up by the fragment shader
+    Indexed
+};
+
+// How vertices are stored in the vertex buffer
+enum class VertexFormat
+{
+    // MeshVertex as decoded, 36 bytes
+    Float,
+    
+    // 16 bytes: shorts within the model bounds, an octahedral normal,
+    // half float texture coordinates and a byte bone index
+    Compact
+};
+
+// Surfaces are drawn in this order, so blend and depth state
+// change at most twice per model
+enum class RenderPass
+{
+    Opaque,
+    
+    // Palette index 255 is cut out
+    Masked,
+    
+    // Added to the frame without writing depth
+    Additive
+};
+
+// Locations of the uniforms that change between surfaces
+struct SurfaceUniforms
+{
+    // STUDIO_NF_* flags
+    int flags;
+    
+    // Layer of the packed texture array, -1 for a surface without a skin
+    int layer;
+    
+    // Size of the skin in texels, a packed layer can be larger
+    int textureSize;
+    
+    // Maps texture coordinates of the family 0 skin to the current one
+    int texCoordScale;
+};
+
+// Every mesh that uses a skinref, merged into one range of the index buffer
 struct RenderableSurface
 {
-    unsigned int tex;
+    int skinRef;
+    int baseTex;
+    
+    // Texture of skinRef in the current skin family, -1 if it has none
+    int tex;
+    int flags;
+    RenderPass pass;
+    glm::vec2 texCoordScale;
+    
     int bufferOffset;
     int indicesCount;
 };
@@ -22,13 +82,30 @@ struct RenderableModel
 {
     ~RenderableModel();
     
-    void init(const Model& model);
+    // With `packTextures` skins are layers of GL_TEXTURE_2D_ARRAYs, one per
+    // size bucket, so the model rebinds textures once per bucket at most
+    void init(const Model& model, TextureMode textureMode = TextureMode::Indexed, bool packTextures = true,
+              VertexFormat vertexFormat = VertexFormat::Float);
     void update(float dt);
-    void draw();
+    void draw(const SurfaceUniforms& uniforms);
     
     void setSeqIndex(int index);
     int getSeqIndex() const;
     
+    // Switching families remaps textures only, nothing is uploaded again
+    void setSkinFamily(int family);
+    int getSkinFamily() const;
+    int getSkinFamilyCount() const;
+    
+    TextureMode getTextureMode() const { return textureMode; }
+    bool isPacked() const { return !textureArrays.empty(); }
+    
+    VertexFormat getVertexFormat() const { return vertexFormat; }
+    
+    // Model space position is positionOffset + positionScale * attribute
+    glm::vec3 getPositionScale() const { return positionScale; }
+    glm::vec3 getPositionOffset() const { return positionOffset; }
+    
     std::string name;
     
     // Transforms for each bone
@@ -38,21 +115,50 @@ private:
     std::vector<Sequence> sequences;
     std::vector<int> bones;
     
+    std::shared_ptr<SequenceCache> sequenceCache;
+    std::shared_ptr<const Sequence> cur_sequence;
+    
     float cur_frame = 0;
     float cur_frame_time = 0;
     float cur_anim_duration = 0;
     int cur_seq_index = 0;
     
+    // Selected sequence whose group file is still loading
+    int pending_seq_index = -1;
+    
     unsigned int vbo;
     unsigned int ibo;
     unsigned int vao;
-    std::vector<unsigned int> textures;
+    
+    VertexFormat vertexFormat = VertexFormat::Float;
+    glm::vec3 positionScale = glm::vec3(1);
+    glm::vec3 positionOffset = glm::vec3(0);
+    
+    // From the TextureRegistry, with a palette each in Indexed mode
+    std::vector<std::shared_ptr<const SharedTexture>> textures;
+    TextureMode textureMode = TextureMode::Indexed;
+    
+    // Packed skins, one array per power of two size bucket. Texture i is
+    // layer textureLayers[i] of textureArrays[textureBuckets[i]]. In Indexed
+    // mode the layers are padded to the largest skin of the bucket and row j
+    // of the palette is the palette of layer j, in RGBA mode they are
+    // resampled to that size.
+    std::vector<std::shared_ptr<const SharedTexture>> textureArrays;
+    std::vector<int> textureBuckets;
+    std::vector<int> textureLayers;
+    std::vector<glm::ivec2> textureSizes;
+    std::vector<int> textureFlags;
+    
+    std::vector<std::vector<int>> skinFamilies;
+    int skinFamily = 0;
     
     std::vector<RenderableSurface> surfaces;
     
 private:
-    void uploadTextures(const std::vector<Texture>& textures);
-    void uploadMeshes(const std::vector<Mesh>& meshes);
+    void uploadTextures(const std::vector<Texture>& textures, const std::vector<uint64_t>& hashes);
+    void uploadTextureArray(const std::vector<Texture>& textures, const std::vector<uint64_t>& hashes);
+    void uploadMeshes(const std::vector<Mesh>& meshes, const std::vector<Texture>& textures);
     
     void updatePose();
+    void updateSkins();
 };
@@ -6,6 +6,7 @@
 //
 
 #include <thread>
+#include <filesystem>
 
 #include "Renderer.h"
 #include "GoldSrcModel.h"
@@ -28,20 +29,55 @@
 
 #include <imgui.h>
 
+// Most the viewer keeps in its cache directory
+static const uint64_t CACHE_SIZE_LIMIT = 512ull << 20;
+
 Renderer::Renderer()
 {
     uploadShader();
+    
+    std::error_code ec;
+    std::filesystem::path temp = std::filesystem::temp_directory_path(ec);
+    
+    if (!ec) {
+        m_cacheDirectory = (temp / "hlmv-cache").string();
+    }
 }
 
 Renderer::~Renderer()
 {
+    // Workers use this, the thread pool and the main queue, none of them
+    // may still run once main() returns
+    joinLoaders(true);
+    
     glDeleteProgram(program);
 }
 
+void Renderer::joinLoaders(bool all)
+{
+    for (auto it = m_loaders.begin(); it != m_loaders.end(); )
+    {
+        if (all) {
+            it->progress->cancelled = true;
+        }
+        else if (!*it->finished) {
+            ++it;
+            continue;
+        }
+        
+        it->thread.join();
+        it = m_loaders.erase(it);
+    }
+}
+
 void Renderer::setModel(const Model& model)
 {
-    m_pmodel = std::make_unique<RenderableModel>();
-    m_pmodel->init(model);
+    // The old model goes only after the new one is uploaded, skins they
+    // share stay in the TextureRegistry
+    auto renderable = std::make_unique<RenderableModel>();
+    renderable->init(model, m_textureMode, true, m_vertexFormat);
+    
+    m_pmodel = std::move(renderable);
     
     sequenceNames.resize(model.sequences.size());
 
@@ -53,6 +89,58 @@ void Renderer::setModel(const Model& model)
 //    isPlayerView = lastSlashPos != std::string::npos && model.name.substr(lastSlashPos + 1).starts_with("v_");
 }
 
+// Parsing runs on a worker thread, only the GL upload in setModel is posted
+// back to the main thread. Opening another file cancels a running load.
+void Renderer::loadModel(const std::string& filename)
+{
+    if (m_loading) {
+        m_loading->cancelled = true;
+    }
+    
+    auto progress = std::make_shared<LoadProgress>();
+    
+    m_loading = progress;
+    m_loadingName = filename;
+    m_filename = filename;
+    
+    ModelLoadOptions options;
+    options.parallel = true;
+    options.compressedAnimations = true;
+    options.progress = progress;
+    options.compressTextures = m_textureMode == TextureMode::RGBA && m_compressTextures;
+    
+    if (m_useCache)
+    {
+        options.cacheDirectory = m_cacheDirectory;
+        options.cacheSizeLimit = CACHE_SIZE_LIMIT;
+    }
+    
+    auto finished = std::make_shared<std::atomic<bool>>(false);
+    
+    std::thread thread([this, filename, progress, options, finished]() {
+        
+        auto model = std::make_shared<Model>();
+        bool loaded = model->loadFromFile(filename, options);
+        
+        MainQueue::instance().async([this, model, loaded, progress]() {
+            
+            // Superseded by a newer load or cancelled. The renderer cancels
+            // its loads before it goes away, `this` is only used after that check.
+            if (progress->cancelled || m_loading != progress) return;
+            
+            m_loading = nullptr;
+            
+            if (loaded) {
+                setModel(*model);
+            }
+        });
+        
+        *finished = true;
+    });
+    
+    m_loaders.push_back({ std::move(thread), progress, finished });
+}
+
 void Renderer::update(float dt)
 {
     if (m_pmodel) {
@@ -60,12 +148,15 @@ void Renderer::update(float dt)
     }
     
     MainQueue::instance().poll();
+    joinLoaders(false);
 }
 
 void Renderer::draw(const Camera& camera)
 {
     glUseProgram(program);
     
+    glm::mat4 modelView;
+    
     if (isPlayerView)
     {
         glm::mat4 quakeToGL = {
@@ -77,6 +168,8 @@ void Renderer::draw(const Camera& camera)
         
         quakeToGL[3] = glm::vec4(weaponOffset, 1);
         
+        modelView = quakeToGL;
+        
         glm::mat4 mvp = camera.projection * quakeToGL;
         glUniformMatrix4fv(u_MVP_loc, 1, GL_FALSE, (const float*) &mvp);
     }
@@ -89,13 +182,32 @@ void Renderer::draw(const Camera& camera)
             {  0,  0,  0,  1 }
         };
         
+        modelView = camera.view * quakeToGL;
+        
         glm::mat4 mvp = camera.projection * camera.view * quakeToGL;
         glUniformMatrix4fv(u_MVP_loc, 1, GL_FALSE, (const float*) &mvp);
     }
     
+    // Chrome is mapped from the viewer's position and right vector in model space
+    glm::mat4 viewToModel = glm::inverse(modelView);
+    glm::vec3 viewOrigin = viewToModel[3];
+    glm::vec3 viewRight = glm::normalize(glm::vec3(viewToModel[0]));
+    
+    glUniform3fv(u_viewOrigin_loc, 1, (const float*) &viewOrigin);
+    glUniform3fv(u_viewRight_loc, 1, (const float*) &viewRight);
+    
     if (m_pmodel) {
+        glUniform1i(u_indexed_loc, m_pmodel->getTextureMode() == TextureMode::Indexed);
+        glUniform1i(u_array_loc, m_pmodel->isPacked());
+        glUniform1i(u_octahedralNormals_loc, m_pmodel->getVertexFormat() == VertexFormat::Compact);
+        
+        glm::vec3 positionScale = m_pmodel->getPositionScale();
+        glm::vec3 positionOffset = m_pmodel->getPositionOffset();
+        glUniform3fv(u_positionScale_loc, 1, (const float*) &positionScale);
+        glUniform3fv(u_positionOffset_loc, 1, (const float*) &positionOffset);
+        
         glUniformMatrix4fv(u_boneTransforms_loc, (GLsizei)(m_pmodel->transforms.size()), GL_FALSE, &(m_pmodel->transforms[0][0][0]));
-        m_pmodel->draw();
+        m_pmodel->draw({ u_flags_loc, u_layer_loc, u_textureSize_loc, u_texCoordScale_loc });
     }
 }
 
@@ -113,16 +225,64 @@ void Renderer::uploadShader()
         uniform mat4 uBoneTransforms[128];
         uniform mat4 uMVP;
         
+        // Compact vertices hold shorts within the model bounds and
+        // octahedral normals, float vertices pass through
+        uniform vec3 uPositionScale;
+        uniform vec3 uPositionOffset;
+        uniform bool uOctahedralNormals;
+        
+        // STUDIO_NF_* flags of the surface
+        uniform int uFlags;
+        
+        // Viewer in model space
+        uniform vec3 uViewOrigin;
+        uniform vec3 uViewRight;
+        
+        uniform ivec2 uTextureSize;
+        
+        // Texture coordinates are made for the skin of family 0
+        uniform vec2 uTexCoordScale;
+        
+        const int STUDIO_NF_CHROME = 0x0002;
+        
         out vec2 uv;
         out vec3 transformedNormal;
         out vec4 transformedPosition;
+        
+        vec3 octahedralDecode(vec2 e)
+        {
+            vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+            
+            if (n.z < 0.0)
+            {
+                n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+            }
+            
+            return normalize(n);
+        }
 
         void main()
         {
-            transformedPosition = uBoneTransforms[boneIndex] * position;
-            transformedNormal = normalize(mat3(uBoneTransforms[boneIndex]) * normal);
+            vec4 modelPosition = vec4(uPositionOffset + uPositionScale * position.xyz, 1.0);
+            vec3 modelNormal = uOctahedralNormals ? octahedralDecode(normal.xy / 32767.0) : normal;
+            
+            transformedPosition = uBoneTransforms[boneIndex] * modelPosition;
+            transformedNormal = normalize(mat3(uBoneTransforms[boneIndex]) * modelNormal);
             gl_Position = uMVP * transformedPosition;
-            uv = texCoord;
+            uv = texCoord * uTexCoordScale;
+            
+            // Same mapping as Valve's hlmv: the normal projected on a frame
+            // facing from the viewer to the bone, 64 texels across
+            if ((uFlags & STUDIO_NF_CHROME) != 0)
+            {
+                vec3 boneOrigin = uBoneTransforms[boneIndex][3].xyz;
+                vec3 dir = normalize(boneOrigin - uViewOrigin);
+                vec3 up = normalize(cross(dir, uViewRight));
+                vec3 right = normalize(cross(dir, up));
+                
+                vec2 chrome = vec2(dot(transformedNormal, right), dot(transformedNormal, up));
+                uv = (chrome + 1.0) * 32.0 / vec2(uTextureSize);
+            }
         }
     )";
     
@@ -134,9 +294,64 @@ void Renderer::uploadShader()
 
         //Texture samplers
         uniform sampler2D s_texture;
+        uniform sampler2D s_palette;
+        uniform sampler2DArray s_textureArray;
+        
+        // s_texture holds palette indices instead of colors
+        uniform bool uIndexed;
+        
+        // Skins are layers of s_textureArray, and rows of s_palette when indexed.
+        // A negative layer is a surface without a skin.
+        uniform bool uArray;
+        uniform int uLayer;
+        
+        // Skin size, a padded layer is larger
+        uniform ivec2 uTextureSize;
+        
+        uniform int uFlags;
+        
+        const int STUDIO_NF_FULLBRIGHT = 0x0004;
+        const int STUDIO_NF_NOMIPS = 0x0008;
+        const int STUDIO_NF_MASKED = 0x0040;
 
         //final color
         out vec4 FragColor;
+        
+        vec4 paletteColor(ivec2 texel, ivec2 size)
+        {
+            // GL_REPEAT by hand
+            texel = (texel % size + size) % size;
+            
+            float value = uArray ? texelFetch(s_textureArray, ivec3(texel, uLayer), 0).r : texelFetch(s_texture, texel, 0).r;
+            
+            int index = int(value * 255.0 + 0.5);
+            vec4 color = texelFetch(s_palette, ivec2(index, uArray ? uLayer : 0), 0);
+            
+            // The last palette entry is the transparent one
+            if ((uFlags & STUDIO_NF_MASKED) != 0 && index == 255) {
+                color.a = 0.0;
+            }
+            
+            return color;
+        }
+        
+        // Indices can't be interpolated, so this is bilinear filtering
+        // of the four looked up colors
+        vec4 sampleIndexed(vec2 uv)
+        {
+            ivec2 size = uTextureSize;
+            vec2 st = uv * vec2(size) - 0.5;
+            
+            ivec2 texel = ivec2(floor(st));
+            vec2 f = fract(st);
+            
+            vec4 c00 = paletteColor(texel, size);
+            vec4 c10 = paletteColor(texel + ivec2(1, 0), size);
+            vec4 c01 = paletteColor(texel + ivec2(0, 1), size);
+            vec4 c11 = paletteColor(texel + ivec2(1, 1), size);
+            
+            return mix(mix(c00, c10, f.x), mix(c01, c11, f.x), f.y);
+        }
 
         void main()
         {
@@ -147,8 +362,34 @@ void Renderer::uploadShader()
     
             float ambient = 0.2;
             shade = min(shade + ambient, 1.0);
+            
+            if ((uFlags & STUDIO_NF_FULLBRIGHT) != 0) {
+                shade = 1.0;
+            }
     
-            FragColor = texture(s_texture, uv) * shade;
+            vec4 color;
+            
+            if (uArray && uLayer < 0) {
+                // Black like an unbound texture
+                color = vec4(0.0, 0.0, 0.0, 1.0);
+            }
+            else if (uIndexed) {
+                color = sampleIndexed(uv);
+            }
+            else if (uArray) {
+                // Mipmaps are shared by the whole array
+                vec3 st = vec3(uv, uLayer);
+                color = (uFlags & STUDIO_NF_NOMIPS) != 0 ? textureLod(s_textureArray, st, 0.0) : texture(s_textureArray, st);
+            }
+            else {
+                color = texture(s_texture, uv);
+            }
+            
+            if ((uFlags & STUDIO_NF_MASKED) != 0 && color.a < 0.5) {
+                discard;
+            }
+            
+            FragColor = color * shade;
         }
     )";
     
@@ -165,10 +406,12 @@ void Renderer::uploadShader()
     glDeleteShader(vs);
     glDeleteShader(fs);
     
-//    glUniform1i(glGetUniformLocation(program, "s_texture"), 0);
-    
     glUseProgram(program);
     
+    glUniform1i(glGetUniformLocation(program, "s_texture"), 0);
+    glUniform1i(glGetUniformLocation(program, "s_palette"), 1);
+    glUniform1i(glGetUniformLocation(program, "s_textureArray"), 2);
+    
     u_MVP_loc = glGetUniformLocation(program, "uMVP");
 
     if (u_MVP_loc == -1)
@@ -182,6 +425,83 @@ void Renderer::uploadShader()
     {
         printf("Shader have no uniform %s\n", "uBoneTransforms");
     }
+    
+    u_positionScale_loc = glGetUniformLocation(program, "uPositionScale");
+
+    if (u_positionScale_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uPositionScale");
+    }
+    
+    u_positionOffset_loc = glGetUniformLocation(program, "uPositionOffset");
+
+    if (u_positionOffset_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uPositionOffset");
+    }
+    
+    u_octahedralNormals_loc = glGetUniformLocation(program, "uOctahedralNormals");
+
+    if (u_octahedralNormals_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uOctahedralNormals");
+    }
+    
+    u_indexed_loc = glGetUniformLocation(program, "uIndexed");
+
+    if (u_indexed_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uIndexed");
+    }
+    
+    u_array_loc = glGetUniformLocation(program, "uArray");
+
+    if (u_array_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uArray");
+    }
+    
+    u_layer_loc = glGetUniformLocation(program, "uLayer");
+
+    if (u_layer_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uLayer");
+    }
+    
+    u_textureSize_loc = glGetUniformLocation(program, "uTextureSize");
+
+    if (u_textureSize_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uTextureSize");
+    }
+    
+    u_texCoordScale_loc = glGetUniformLocation(program, "uTexCoordScale");
+
+    if (u_texCoordScale_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uTexCoordScale");
+    }
+    
+    u_flags_loc = glGetUniformLocation(program, "uFlags");
+
+    if (u_flags_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uFlags");
+    }
+    
+    u_viewOrigin_loc = glGetUniformLocation(program, "uViewOrigin");
+
+    if (u_viewOrigin_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uViewOrigin");
+    }
+    
+    u_viewRight_loc = glGetUniformLocation(program, "uViewRight");
+
+    if (u_viewRight_loc == -1)
+    {
+        printf("Shader have no uniform %s\n", "uViewRight");
+    }
 }
 
 void Renderer::imgui_draw()
@@ -193,12 +513,7 @@ void Renderer::imgui_draw()
             if (ImGui::MenuItem("Open", "Ctrl+O"))
             {
                 openFile([this](std::string filename) {
-
-                    Model mdl;
-                    mdl.loadFromFile(filename);
-                    
-                    setModel(mdl);
-                    
+                    loadModel(filename);
                 }, "*.mdl");
             }
 
@@ -210,6 +525,25 @@ void Renderer::imgui_draw()
         ImGui::EndMainMenuBar();
     }
     
+    if (m_loading)
+    {
+        ImGui::SetNextWindowSize(ImVec2(300, 0));
+        
+        if (ImGui::Begin("Loading###loading", nullptr, ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoResize))
+        {
+            ImGui::TextWrapped("%s", m_loadingName.c_str());
+            ImGui::ProgressBar(m_loading->value);
+            
+            if (ImGui::Button("Cancel"))
+            {
+                m_loading->cancelled = true;
+                m_loading = nullptr;
+            }
+        }
+        
+        ImGui::End();
+    }
+    
     if (m_pmodel == nullptr) return;
     if (m_pmodel->getSeqIndex() >= sequenceNames.size()) return;
     
@@ -248,6 +582,45 @@ void Renderer::imgui_draw()
         
         ImGui::PopItemWidth();
         
+        const char* textureModes[] = { "Indexed", "RGBA", "RGBA, BC1/BC3" };
+        int textureMode = m_textureMode == TextureMode::Indexed ? 0 : (m_compressTextures ? 2 : 1);
+        
+        if (ImGui::Combo("Textures", &textureMode, textureModes, IM_ARRAYSIZE(textureModes)))
+        {
+            m_textureMode = textureMode == 0 ? TextureMode::Indexed : TextureMode::RGBA;
+            m_compressTextures = textureMode == 2;
+            
+            loadModel(m_filename);
+        }
+        
+        const char* vertexFormats[] = { "Float, 36 bytes", "Compact, 16 bytes" };
+        int vertexFormat = m_vertexFormat == VertexFormat::Float ? 0 : 1;
+        
+        if (ImGui::Combo("Vertices", &vertexFormat, vertexFormats, IM_ARRAYSIZE(vertexFormats)))
+        {
+            m_vertexFormat = vertexFormat == 0 ? VertexFormat::Float : VertexFormat::Compact;
+            
+            loadModel(m_filename);
+        }
+        
+        if (m_pmodel->getSkinFamilyCount() > 1)
+        {
+            int skin = m_pmodel->getSkinFamily();
+            
+            if (ImGui::SliderInt("Skin", &skin, 0, m_pmodel->getSkinFamilyCount() - 1)) {
+                m_pmodel->setSkinFamily(skin);
+            }
+        }
+        
+        if (!m_cacheDirectory.empty())
+        {
+            ImGui::Checkbox("Cache decoded models", &m_useCache);
+            
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("%s, up to %llu MB", m_cacheDirectory.c_str(), (unsigned long long)(CACHE_SIZE_LIMIT >> 20));
+            }
+        }
+        
         ImGui::Checkbox("Player View", &isPlayerView);
         ImGui::InputFloat3("Weapon offset", (float*)&weaponOffset);
         
@@ -263,8 +636,9 @@ void Renderer::openFile(std::function<void (std::string)> callback, const char*
         
         if (filename != nullptr)
         {
-            MainQueue::instance().async([callback, filename] () {
-                callback(filename);
+            // The dialog returns a static buffer, copy it before leaving the thread
+            MainQueue::instance().async([callback, path = std::string(filename)] () {
+                callback(path);
             });
         }
         
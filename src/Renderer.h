@@ -8,6 +8,9 @@
 #pragma once
 
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
 #include <functional>
 
 #include <glm/glm.hpp>
@@ -24,6 +27,7 @@ struct Renderer
     ~Renderer();
     
     void setModel(const Model& model);
+    void loadModel(const std::string& filename);
     void update(float dt);
     void draw(const Camera& camera);
     void imgui_draw();
@@ -34,9 +38,50 @@ private:
     unsigned int program;
     unsigned int u_MVP_loc;
     unsigned int u_boneTransforms_loc;
+    int u_positionScale_loc;
+    int u_positionOffset_loc;
+    int u_octahedralNormals_loc;
+    int u_indexed_loc;
+    int u_array_loc;
+    int u_layer_loc;
+    int u_textureSize_loc;
+    int u_texCoordScale_loc;
+    int u_flags_loc;
+    int u_viewOrigin_loc;
+    int u_viewRight_loc;
     
     std::unique_ptr<RenderableModel> m_pmodel;
     
+    // Load running on a worker thread, null when idle
+    std::shared_ptr<LoadProgress> m_loading;
+    std::string m_loadingName;
+    
+    // Every worker still owned, superseded ones keep running until they
+    // notice the cancellation. Finished ones are joined in update(), the
+    // rest are cancelled and joined when the renderer goes away.
+    struct Loader
+    {
+        std::thread thread;
+        std::shared_ptr<LoadProgress> progress;
+        std::shared_ptr<std::atomic<bool>> finished;
+    };
+    
+    std::vector<Loader> m_loaders;
+    
+    void joinLoaders(bool all);
+    
+    // Last opened file, loaded again when the texture settings change
+    std::string m_filename;
+    
+    TextureMode m_textureMode = TextureMode::Indexed;
+    bool m_compressTextures = false;
+    VertexFormat m_vertexFormat = VertexFormat::Float;
+    
+    // Decoded models and compressed skins, in the system temp directory.
+    // Off unless enabled in the UI, trimmed to CACHE_SIZE_LIMIT.
+    std::string m_cacheDirectory;
+    bool m_useCache = false;
+    
     //ImGui stuff
     std::vector<std::string> sequenceNames;
     
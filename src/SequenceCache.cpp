@@ -0,0 +1,251 @@
+//
+//  SequenceCache.cpp
+//  hlmv
+//
+
+#include "SequenceCache.h"
+#include "MappedFile.h"
+#include "ModelValidator.h"
+#include "ModelCache.h"
+#include "ThreadPool.h"
+
+#include <stdio.h>
+
+SequenceCache::SequenceCache(std::shared_ptr<const MappedFile> file, const std::string& filename, size_t capacity, bool useMmap,
+                             bool compressed, std::shared_ptr<const MappedFile> cacheFile)
+    : m_file(std::move(file)), m_cacheFile(std::move(cacheFile)), m_filename(filename), m_capacity(capacity > 0 ? capacity : 1),
+      m_useMmap(useMmap), m_compressed(compressed)
+{
+    const studiohdr_t* pheader = (const studiohdr_t *)m_file->data().data();
+    m_groups.resize(pheader->numseqgroups > 1 ? pheader->numseqgroups : 1);
+    m_count = pheader->numseq;
+}
+
+std::shared_ptr<const Sequence> SequenceCache::get(int index, bool wait)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    
+    auto it = m_entries.find(index);
+    
+    if (it != m_entries.end())
+    {
+        m_lru.splice(m_lru.begin(), m_lru, it->second.lruPosition);
+        return it->second.sequence;
+    }
+    
+    auto sequence = decode(lock, index, wait);
+    if (sequence == nullptr) return nullptr;
+    
+    // Someone else could have decoded it in the meantime
+    it = m_entries.find(index);
+    
+    if (it != m_entries.end())
+    {
+        m_lru.splice(m_lru.begin(), m_lru, it->second.lruPosition);
+        return it->second.sequence;
+    }
+    
+    if (m_entries.size() >= m_capacity)
+    {
+        m_entries.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+    
+    m_lru.push_front(index);
+    m_entries[index] = { sequence, m_lru.begin() };
+    
+    return sequence;
+}
+
+std::shared_ptr<const Sequence> SequenceCache::getTransient(int index)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    
+    auto it = m_entries.find(index);
+    if (it != m_entries.end()) return it->second.sequence;
+    
+    return decode(lock, index, true);
+}
+
+size_t SequenceCache::decodedCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_decodedCount;
+}
+
+std::shared_ptr<const Sequence> SequenceCache::decode(std::unique_lock<std::mutex>& lock, int index, bool wait)
+{
+    if (m_file == nullptr) return nullptr;
+    if (index < 0 || index >= m_count) return nullptr;
+    
+    auto file = m_file;
+    std::shared_ptr<const MappedFile> animfile = file;
+    std::shared_ptr<const MappedFile> cacheFile = isCached(index) ? m_cacheFile : nullptr;
+    
+    int group = cacheFile ? 0 : sequenceDesc(index).seqgroup;
+    
+    if (group != 0)
+    {
+        GroupFile groupFile = requestGroup(group);
+        
+        if (wait)
+        {
+            lock.unlock();
+            groupFile.wait();
+            lock.lock();
+        }
+        else if (groupFile.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            return nullptr;
+        }
+        
+        animfile = groupFile.get();
+        if (animfile == nullptr) return nullptr;
+    }
+    
+    // Decode without holding the lock so sequences can be decoded in parallel
+    lock.unlock();
+    
+    auto sequence = std::make_shared<Sequence>();
+    
+    if (cacheFile) {
+        readCachedSequence(cacheFile->data(), index, *sequence);
+    }
+    else {
+        decodeSequence(file->data().data(), animfile->data().data(), index, *sequence, m_compressed);
+    }
+    
+    lock.lock();
+    
+    if (cacheFile == nullptr) {
+        m_decodedCount++;
+    }
+    
+    return sequence;
+}
+
+bool SequenceCache::isLoading(int index) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    
+    if (m_file == nullptr) return false;
+    if (index < 0 || index >= m_count || isCached(index)) return false;
+    
+    int group = sequenceDesc(index).seqgroup;
+    if (group == 0 || !m_groups[group].valid()) return false;
+    
+    return m_groups[group].wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+void SequenceCache::decodeAll(bool parallel)
+{
+    int count = 0;
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        if (m_file == nullptr) return;
+        
+        count = m_count;
+        
+        // Start reading all group files at once
+        for (int i = 0; i < count; ++i)
+        {
+            if (isCached(i)) continue;
+            
+            int group = sequenceDesc(i).seqgroup;
+            if (group != 0) requestGroup(group);
+        }
+    }
+    
+    if (parallel)
+    {
+        ThreadPool::instance().parallelFor(count, [this](size_t i) { get((int)i, true); });
+        return;
+    }
+    
+    for (int i = 0; i < count; ++i)
+    {
+        get(i, true);
+    }
+}
+
+void SequenceCache::releaseFile()
+{
+    std::vector<GroupFile> groups;
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_file = nullptr;
+        m_cacheFile = nullptr;
+        std::swap(groups, m_groups);
+    }
+    
+    // Dropping the last reference waits for reads still in flight
+    groups.clear();
+}
+
+std::shared_ptr<const Sequence> SequenceCache::resident(int index) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    
+    auto it = m_entries.find(index);
+    return it != m_entries.end() ? it->second.sequence : nullptr;
+}
+
+size_t SequenceCache::residentCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+SequenceCache::GroupFile& SequenceCache::requestGroup(int group)
+{
+    GroupFile& groupFile = m_groups[group];
+    
+    if (!groupFile.valid())
+    {
+        groupFile = std::async(std::launch::async, loadGroup, m_file, m_filename, group, m_useMmap).share();
+    }
+    
+    return groupFile;
+}
+
+std::shared_ptr<const MappedFile> SequenceCache::loadGroup(std::shared_ptr<const MappedFile> model, std::string filename, int group, bool useMmap)
+{
+    // A model from memory has no files next to it
+    if (filename.empty()) return nullptr;
+    
+    filename = sequenceGroupFilename(filename, group);
+    
+    auto file = std::make_shared<MappedFile>();
+    
+    if (!file->open(filename, useMmap))
+    {
+        printf("unable to open sequence group %s\n", filename.c_str());
+        return nullptr;
+    }
+    
+    std::string error;
+    
+    if (!validateSequenceGroup(model->data(), file->data(), group, error))
+    {
+        printf("%s is not a valid sequence group: %s\n", filename.c_str(), error.c_str());
+        return nullptr;
+    }
+    
+    return file;
+}
+
+bool SequenceCache::isCached(int index) const
+{
+    return m_cacheFile != nullptr && hasCachedSequence(m_cacheFile->data(), index);
+}
+
+const mstudioseqdesc_t& SequenceCache::sequenceDesc(int index) const
+{
+    const byte* pin = m_file->data().data();
+    const studiohdr_t* pheader = (const studiohdr_t *)pin;
+    
+    return ((const mstudioseqdesc_t *)(pin + pheader->seqindex))[index];
+}
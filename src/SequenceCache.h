@@ -0,0 +1,102 @@
+//
+//  SequenceCache.h
+//  hlmv
+//
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "GoldSrcModel.h"
+
+class MappedFile;
+
+// Decodes sequences of a model the first time they are requested.
+// At most `capacity` decoded sequences stay resident, the least recently
+// used one is dropped first. Callers keep an evicted sequence alive for
+// as long as they hold its pointer.
+//
+// Sequences of group N > 0 keep their animation in modelNN.mdl next to
+// the model. The group file is read on a background thread the first time
+// one of its sequences is requested and stays cached afterwards.
+//
+// Sequences whose frames are in a model cache file (.mdlc) are copied out
+// of that file instead and never need their group file.
+class SequenceCache
+{
+public:
+    // With `compressed` sequences keep their spans instead of expanded frames.
+    // `cacheFile` is optional and comes from readModelCache.
+    SequenceCache(std::shared_ptr<const MappedFile> file, const std::string& filename, size_t capacity, bool useMmap,
+                  bool compressed = false, std::shared_ptr<const MappedFile> cacheFile = nullptr);
+    
+    // Returns nullptr if the sequence can't be decoded or its group file
+    // is still loading. With `wait` it blocks until the group file is read.
+    std::shared_ptr<const Sequence> get(int index, bool wait = false);
+    
+    // True while the group file of the sequence is being read
+    bool isLoading(int index) const;
+    
+    // Decodes every sequence, group files are always read in parallel.
+    // With `parallel` the sequences are decoded on the thread pool.
+    void decodeAll(bool parallel = false);
+    
+    // Stops decoding new sequences, only resident ones are served afterwards
+    void releaseFile();
+    
+    // The sequence if it is decoded already, without decoding it or
+    // touching its place in the eviction order
+    std::shared_ptr<const Sequence> resident(int index) const;
+    
+    // Like get(index, true), but a sequence that isn't resident is decoded
+    // without keeping it, so the ones in use stay resident
+    std::shared_ptr<const Sequence> getTransient(int index);
+    
+    size_t residentCount() const;
+    
+    // Sequences decoded from the model or its group files so far, the ones
+    // copied out of the model cache don't count
+    size_t decodedCount() const;
+    
+private:
+    struct Entry
+    {
+        std::shared_ptr<const Sequence> sequence;
+        std::list<int>::iterator lruPosition;
+    };
+    
+    using GroupFile = std::shared_future<std::shared_ptr<const MappedFile>>;
+    
+    // Called and returns with the lock held, which is released while decoding
+    std::shared_ptr<const Sequence> decode(std::unique_lock<std::mutex>& lock, int index, bool wait);
+    
+    GroupFile& requestGroup(int group);
+    static std::shared_ptr<const MappedFile> loadGroup(std::shared_ptr<const MappedFile> model, std::string filename, int group, bool useMmap);
+    
+    const mstudioseqdesc_t& sequenceDesc(int index) const;
+    bool isCached(int index) const;
+    
+    std::shared_ptr<const MappedFile> m_file;
+    std::shared_ptr<const MappedFile> m_cacheFile;
+    std::string m_filename;
+    size_t m_capacity;
+    bool m_useMmap = false;
+    bool m_compressed = false;
+    int m_count = 0;
+    size_t m_decodedCount = 0;
+    
+    // Index 0 is unused, that group is the model itself
+    std::vector<GroupFile> m_groups;
+    
+    // Most recently used first
+    std::list<int> m_lru;
+    std::unordered_map<int, Entry> m_entries;
+    
+    mutable std::mutex m_mutex;
+};
@@ -0,0 +1,493 @@
+//
+//  TextureCompression.cpp
+//  hlmv
+//
+
+#include "TextureCompression.h"
+#include "MappedFile.h"
+#include "ModelCache.h"
+#include "Palette.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <filesystem>
+
+struct texcachehdr_t
+{
+    int                 id;
+    int                 version;
+    uint64_t            hash;
+
+    int                 format;
+    int                 width;      // of level 0
+    int                 height;
+    int                 numlevels;  // blocks of each level follow the header
+
+    int                 length;
+    int                 unused;
+};
+
+static int blockSize(BlockFormat format)
+{
+    return format == BlockFormat::BC1 ? 8 : 16;
+}
+
+size_t compressedSize(BlockFormat format, int width, int height)
+{
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockSize(format);
+}
+
+// 5:6:5 with the same bit replication the decoder uses
+static uint16_t pack565(const float color[3])
+{
+    int r = std::clamp((int)(color[0] * 31.0f / 255.0f + 0.5f), 0, 31);
+    int g = std::clamp((int)(color[1] * 63.0f / 255.0f + 0.5f), 0, 63);
+    int b = std::clamp((int)(color[2] * 31.0f / 255.0f + 0.5f), 0, 31);
+
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void unpack565(uint16_t packed, int color[3])
+{
+    int r = (packed >> 11) & 31;
+    int g = (packed >> 5) & 63;
+    int b = packed & 31;
+
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+}
+
+// Picks the closest of the four block colors for every pixel and returns
+// the squared error. `c0` > `c1`, otherwise index 3 would be transparent.
+static int selectIndices(const byte* block, uint16_t c0, uint16_t c1, uint32_t& indices)
+{
+    int colors[4][3];
+    unpack565(c0, colors[0]);
+    unpack565(c1, colors[1]);
+
+    for (int c = 0; c < 3; ++c)
+    {
+        colors[2][c] = (2 * colors[0][c] + colors[1][c]) / 3;
+        colors[3][c] = (colors[0][c] + 2 * colors[1][c]) / 3;
+    }
+
+    indices = 0;
+    int error = 0;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        const byte* pixel = block + i * 4;
+
+        int best = 0;
+        int bestError = INT_MAX;
+
+        for (int j = 0; j < 4; ++j)
+        {
+            int dr = pixel[0] - colors[j][0];
+            int dg = pixel[1] - colors[j][1];
+            int db = pixel[2] - colors[j][2];
+            int e = dr * dr + dg * dg + db * db;
+
+            if (e < bestError)
+            {
+                best = j;
+                bestError = e;
+            }
+        }
+
+        indices |= (uint32_t)best << (i * 2);
+        error += bestError;
+    }
+
+    return error;
+}
+
+// Least squares endpoints for a given choice of indices
+static bool refineEndpoints(const byte* block, uint32_t indices, uint16_t& c0, uint16_t& c1)
+{
+    static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+
+    float aa = 0, ab = 0, bb = 0;
+    float ax[3] = { }, bx[3] = { };
+
+    for (int i = 0; i < 16; ++i)
+    {
+        float w = weights[(indices >> (i * 2)) & 3];
+
+        aa += w * w;
+        ab += w * (1 - w);
+        bb += (1 - w) * (1 - w);
+
+        for (int c = 0; c < 3; ++c)
+        {
+            ax[c] += w * block[i * 4 + c];
+            bx[c] += (1 - w) * block[i * 4 + c];
+        }
+    }
+
+    float det = aa * bb - ab * ab;
+    if (fabsf(det) < 1e-6f) return false;
+
+    float a[3], b[3];
+
+    for (int c = 0; c < 3; ++c)
+    {
+        a[c] = (bb * ax[c] - ab * bx[c]) / det;
+        b[c] = (aa * bx[c] - ab * ax[c]) / det;
+    }
+
+    c0 = pack565(a);
+    c1 = pack565(b);
+
+    if (c0 < c1) std::swap(c0, c1);
+
+    return true;
+}
+
+// Endpoints at the extremes of the principal axis of the block's colors
+static void encodeColors(const byte* block, byte* out)
+{
+    float mean[3] = { };
+
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 3; ++c) mean[c] += block[i * 4 + c] / 16.0f;
+    }
+
+    // rr rg rb gg gb bb
+    float cov[6] = { };
+
+    for (int i = 0; i < 16; ++i)
+    {
+        float r = block[i * 4 + 0] - mean[0];
+        float g = block[i * 4 + 1] - mean[1];
+        float b = block[i * 4 + 2] - mean[2];
+
+        cov[0] += r * r;
+        cov[1] += r * g;
+        cov[2] += r * b;
+        cov[3] += g * g;
+        cov[4] += g * b;
+        cov[5] += b * b;
+    }
+
+    float axis[3] = { 0.9f, 1.0f, 0.7f };
+
+    for (int iteration = 0; iteration < 8; ++iteration)
+    {
+        float r = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+        float g = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+        float b = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+
+        float length = std::max(fabsf(r), std::max(fabsf(g), fabsf(b)));
+
+        // A flat block, any axis will do
+        if (length < 1e-6f) break;
+
+        axis[0] = r / length;
+        axis[1] = g / length;
+        axis[2] = b / length;
+    }
+
+    int lo = 0, hi = 0;
+    float loDot = FLT_MAX, hiDot = -FLT_MAX;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        float d = block[i * 4 + 0] * axis[0] + block[i * 4 + 1] * axis[1] + block[i * 4 + 2] * axis[2];
+
+        if (d < loDot) { loDot = d; lo = i; }
+        if (d > hiDot) { hiDot = d; hi = i; }
+    }
+
+    float hiColor[3] = { (float)block[hi * 4 + 0], (float)block[hi * 4 + 1], (float)block[hi * 4 + 2] };
+    float loColor[3] = { (float)block[lo * 4 + 0], (float)block[lo * 4 + 1], (float)block[lo * 4 + 2] };
+
+    uint16_t c0 = pack565(hiColor);
+    uint16_t c1 = pack565(loColor);
+
+    if (c0 < c1) std::swap(c0, c1);
+
+    uint32_t indices;
+    int error = selectIndices(block, c0, c1, indices);
+
+    uint16_t r0, r1;
+
+    if (error > 0 && refineEndpoints(block, indices, r0, r1))
+    {
+        uint32_t refined;
+
+        if (selectIndices(block, r0, r1, refined) < error)
+        {
+            c0 = r0;
+            c1 = r1;
+            indices = refined;
+        }
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        out[4 + i] = (indices >> (i * 8)) & 0xff;
+    }
+}
+
+// Eight alpha steps between the block's minimum and maximum
+static void encodeAlpha(const byte* block, byte* out)
+{
+    int lo = 255, hi = 0;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        lo = std::min(lo, (int)block[i * 4 + 3]);
+        hi = std::max(hi, (int)block[i * 4 + 3]);
+    }
+
+    out[0] = hi;
+    out[1] = lo;
+
+    uint64_t bits = 0;
+
+    // With equal endpoints indices 6 and 7 would mean 0 and 255, index 0 is right for all
+    if (hi > lo)
+    {
+        int values[8] = { hi, lo };
+
+        for (int j = 2; j < 8; ++j)
+        {
+            values[j] = ((8 - j) * hi + (j - 1) * lo) / 7;
+        }
+
+        for (int i = 0; i < 16; ++i)
+        {
+            int alpha = block[i * 4 + 3];
+            int best = 0;
+
+            for (int j = 1; j < 8; ++j)
+            {
+                if (abs(values[j] - alpha) < abs(values[best] - alpha)) best = j;
+            }
+
+            bits |= (uint64_t)best << (i * 3);
+        }
+    }
+
+    for (int i = 0; i < 6; ++i)
+    {
+        out[2 + i] = (bits >> (i * 8)) & 0xff;
+    }
+}
+
+void encodeBlocks(const byte* rgba, int width, int height, BlockFormat format, byte* blocks)
+{
+    byte block[16 * 4];
+
+    for (int by = 0; by < height; by += 4)
+    {
+        for (int bx = 0; bx < width; bx += 4)
+        {
+            for (int y = 0; y < 4; ++y)
+            {
+                int sy = std::min(by + y, height - 1);
+
+                for (int x = 0; x < 4; ++x)
+                {
+                    int sx = std::min(bx + x, width - 1);
+                    memcpy(block + (y * 4 + x) * 4, rgba + (sy * width + sx) * 4, 4);
+                }
+            }
+
+            if (format == BlockFormat::BC3)
+            {
+                encodeAlpha(block, blocks);
+                encodeColors(block, blocks + 8);
+            }
+            else
+            {
+                encodeColors(block, blocks);
+            }
+
+            blocks += blockSize(format);
+        }
+    }
+}
+
+std::vector<byte> expandTexture(const Texture& texture)
+{
+    std::vector<byte> rgba(texture.width * texture.height * 4);
+    expandPalette(texture.indices.data(), texture.palette.data(), texture.indices.size(), rgba.data());
+
+    // The indexed path cuts index 255 out in the shader
+    if (texture.flags & STUDIO_NF_MASKED)
+    {
+        for (size_t i = 0; i < texture.indices.size(); ++i)
+        {
+            if (texture.indices[i] == 255) rgba[i * 4 + 3] = 0;
+        }
+    }
+
+    return rgba;
+}
+
+// 2x2 box filter, a 1 texel wide side stays 1 wide
+static std::vector<byte> downsample(const std::vector<byte>& rgba, int width, int height)
+{
+    int dstWidth = std::max(1, width / 2);
+    int dstHeight = std::max(1, height / 2);
+
+    std::vector<byte> result(dstWidth * dstHeight * 4);
+
+    for (int y = 0; y < dstHeight; ++y)
+    {
+        int y0 = std::min(y * 2, height - 1);
+        int y1 = std::min(y * 2 + 1, height - 1);
+
+        for (int x = 0; x < dstWidth; ++x)
+        {
+            int x0 = std::min(x * 2, width - 1);
+            int x1 = std::min(x * 2 + 1, width - 1);
+
+            for (int c = 0; c < 4; ++c)
+            {
+                int sum = rgba[(y0 * width + x0) * 4 + c] + rgba[(y0 * width + x1) * 4 + c] +
+                          rgba[(y1 * width + x0) * 4 + c] + rgba[(y1 * width + x1) * 4 + c];
+
+                result[(y * dstWidth + x) * 4 + c] = (byte)((sum + 2) / 4);
+            }
+        }
+    }
+
+    return result;
+}
+
+std::shared_ptr<const CompressedTexture> compressTexture(const Texture& texture)
+{
+    if (texture.width <= 0 || texture.height <= 0) return nullptr;
+    if (texture.indices.size() != (size_t)texture.width * texture.height) return nullptr;
+
+    auto result = std::make_shared<CompressedTexture>();
+    result->format = (texture.flags & STUDIO_NF_MASKED) ? BlockFormat::BC3 : BlockFormat::BC1;
+
+    std::vector<byte> rgba = expandTexture(texture);
+    int width = texture.width;
+    int height = texture.height;
+
+    while (true)
+    {
+        CompressedLevel& level = result->levels.emplace_back();
+        level.width = width;
+        level.height = height;
+        level.data.resize(compressedSize(result->format, width, height));
+
+        encodeBlocks(rgba.data(), width, height, result->format, level.data.data());
+
+        if ((texture.flags & STUDIO_NF_NOMIPS) || (width == 1 && height == 1)) break;
+
+        rgba = downsample(rgba, width, height);
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+
+    return result;
+}
+
+uint64_t hashTexture(const Texture& texture)
+{
+    uint64_t hash = hashBytes(texture.indices);
+    hash = hashBytes(texture.palette, hash);
+
+    int fields[3] = { texture.width, texture.height, texture.flags };
+
+    return hashBytes({ (const byte *)fields, sizeof(fields) }, hash);
+}
+
+std::string textureCachePath(const std::string& directory, uint64_t hash)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bctx", (unsigned long long)hash);
+
+    return (std::filesystem::path(directory) / name).string();
+}
+
+std::shared_ptr<const CompressedTexture> readTextureCache(const std::string& path, uint64_t hash)
+{
+    MappedFile file;
+    if (!file.open(path)) return nullptr;
+
+    std::span<const byte> data = file.data();
+    if (data.size() < sizeof(texcachehdr_t)) return nullptr;
+
+    texcachehdr_t header;
+    memcpy(&header, data.data(), sizeof(header));
+
+    if (header.id != IDTEXTURECACHEHEADER || header.version != TEXTURECACHE_VERSION) return nullptr;
+    if (header.hash != hash || (size_t)header.length != data.size()) return nullptr;
+    if (header.format != (int)BlockFormat::BC1 && header.format != (int)BlockFormat::BC3) return nullptr;
+    if (header.width <= 0 || header.width > 4096 || header.height <= 0 || header.height > 4096) return nullptr;
+    if (header.numlevels <= 0 || header.numlevels > 13) return nullptr;
+
+    auto result = std::make_shared<CompressedTexture>();
+    result->format = (BlockFormat)header.format;
+
+    size_t offset = sizeof(header);
+    int width = header.width;
+    int height = header.height;
+
+    for (int i = 0; i < header.numlevels; ++i)
+    {
+        size_t size = compressedSize(result->format, width, height);
+        if (offset + size > data.size()) return nullptr;
+
+        CompressedLevel& level = result->levels.emplace_back();
+        level.width = width;
+        level.height = height;
+        level.data.assign(data.begin() + offset, data.begin() + offset + size);
+
+        offset += size;
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+
+    if (offset != data.size()) return nullptr;
+
+    return result;
+}
+
+bool writeTextureCache(const std::string& path, uint64_t hash, const CompressedTexture& texture)
+{
+    if (texture.levels.empty()) return false;
+
+    std::vector<byte> image(sizeof(texcachehdr_t));
+
+    for (auto& level : texture.levels)
+    {
+        image.insert(image.end(), level.data.begin(), level.data.end());
+    }
+
+    if (image.size() > INT32_MAX) return false;
+
+    texcachehdr_t header = { };
+    header.id = IDTEXTURECACHEHEADER;
+    header.version = TEXTURECACHE_VERSION;
+    header.hash = hash;
+    header.format = (int)texture.format;
+    header.width = texture.levels[0].width;
+    header.height = texture.levels[0].height;
+    header.numlevels = (int)texture.levels.size();
+    header.length = (int)image.size();
+
+    memcpy(image.data(), &header, sizeof(header));
+
+    return writeCacheFile(path, image);
+}
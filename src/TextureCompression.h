@@ -0,0 +1,66 @@
+//
+//  TextureCompression.h
+//  hlmv
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "GoldSrcModel.h"
+
+// Skins for the RGBA path, encoded on the CPU into BC1 (DXT1) blocks, or
+// BC3 (DXT5) for masked skins that need alpha, together with their whole
+// mip chain. Encoding is slow compared to loading, so the result is kept
+// as a .bctx file in the cache directory, named after a hash of the
+// indexed texture. Skins shared by several models are encoded once.
+
+#define IDTEXTURECACHEHEADER (('X'<<24)+('T'<<16)+('C'<<8)+'B') // little-endian "BCTX"
+#define TEXTURECACHE_VERSION 1
+
+enum class BlockFormat
+{
+    // 8 bytes per 4x4 block, opaque
+    BC1,
+
+    // 16 bytes per block, BC1 colors after 8 bytes of interpolated alpha
+    BC3
+};
+
+struct CompressedLevel
+{
+    int width;
+    int height;
+    std::vector<byte> data;
+};
+
+struct CompressedTexture
+{
+    BlockFormat format;
+
+    // Level 0 first, down to 1x1 unless the skin has STUDIO_NF_NOMIPS
+    std::vector<CompressedLevel> levels;
+};
+
+size_t compressedSize(BlockFormat format, int width, int height);
+
+// Edge pixels are repeated to fill blocks that stick out of the image
+void encodeBlocks(const byte* rgba, int width, int height, BlockFormat format, byte* blocks);
+
+// The pixels the RGBA path shows: palette expanded and, in masked skins,
+// index 255 made transparent
+std::vector<byte> expandTexture(const Texture& texture);
+
+std::shared_ptr<const CompressedTexture> compressTexture(const Texture& texture);
+
+// Hash of everything compressTexture reads
+uint64_t hashTexture(const Texture& texture);
+
+std::string textureCachePath(const std::string& directory, uint64_t hash);
+
+// Returns null when the file is missing, stale or damaged
+std::shared_ptr<const CompressedTexture> readTextureCache(const std::string& path, uint64_t hash);
+bool writeTextureCache(const std::string& path, uint64_t hash, const CompressedTexture& texture);
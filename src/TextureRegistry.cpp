@@ -0,0 +1,35 @@
+//
+//  TextureRegistry.cpp
+//  hlmv
+//
+
+#include "TextureRegistry.h"
+#include <glad/glad.h>
+
+SharedTexture::~SharedTexture()
+{
+    glDeleteTextures(1, &texture);
+    glDeleteTextures(1, &palette);
+}
+
+std::shared_ptr<const SharedTexture> TextureRegistry::acquire(uint64_t key, const std::function<void(SharedTexture&)>& upload)
+{
+    auto it = m_textures.find(key);
+    
+    if (it != m_textures.end())
+    {
+        if (auto texture = it->second.lock()) return texture;
+    }
+    
+    // The entry leaves the map together with the last reference
+    std::shared_ptr<SharedTexture> texture(new SharedTexture(), [this, key](SharedTexture* texture) {
+        m_textures.erase(key);
+        delete texture;
+    });
+    
+    upload(*texture);
+    
+    m_textures[key] = texture;
+    
+    return texture;
+}
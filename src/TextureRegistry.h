@@ -0,0 +1,49 @@
+//
+//  TextureRegistry.h
+//  hlmv
+//
+
+#pragma once
+
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <stdint.h>
+
+// GL objects of one uploaded skin, or of a packed array of skins.
+// Deleted when the last model using them goes away.
+struct SharedTexture
+{
+    ~SharedTexture();
+    
+    unsigned int texture = 0;
+    
+    // Indexed mode only
+    unsigned int palette = 0;
+};
+
+// Textures shared by every RenderableModel, found by a hash of their
+// content. Models shipping the same skins upload them once and later
+// models skip the palette expansion. GL objects belong to the main
+// thread, so this is only used from there.
+class TextureRegistry
+{
+public:
+    static TextureRegistry& instance()
+    {
+        static TextureRegistry registry;
+        return registry;
+    }
+    
+    // Hands out the texture stored under `key`. The first caller creates it
+    // with `upload`, which fills in the GL names.
+    std::shared_ptr<const SharedTexture> acquire(uint64_t key, const std::function<void(SharedTexture&)>& upload);
+    
+    // Textures alive right now
+    size_t size() const { return m_textures.size(); }
+    
+private:
+    TextureRegistry() = default;
+    
+    std::unordered_map<uint64_t, std::weak_ptr<const SharedTexture>> m_textures;
+};
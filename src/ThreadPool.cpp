@@ -0,0 +1,126 @@
+//
+//  ThreadPool.cpp
+//  hlmv
+//
+
+#include "ThreadPool.h"
+#include <atomic>
+#include <memory>
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool(std::thread::hardware_concurrency());
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t threads)
+{
+    if (threads == 0) threads = 1;
+    
+    for (size_t i = 0; i < threads; ++i)
+    {
+        m_workers.emplace_back([this]() { work(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    
+    m_condition.notify_all();
+    
+    for (auto& worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& fn)
+{
+    if (count == 0) return;
+    
+    if (count == 1)
+    {
+        fn(0);
+        return;
+    }
+    
+    struct Batch
+    {
+        std::atomic<size_t> next = 0;
+        std::atomic<size_t> done = 0;
+        size_t count;
+        const std::function<void(size_t)>* fn;
+        
+        std::mutex mutex;
+        std::condition_variable finished;
+        
+        // Takes items until there are none left
+        void run()
+        {
+            size_t processed = 0;
+            
+            for (size_t i = next++; i < count; i = next++)
+            {
+                (*fn)(i);
+                processed++;
+            }
+            
+            if (processed > 0 && done.fetch_add(processed) + processed == count)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.notify_all();
+            }
+        }
+    };
+    
+    auto batch = std::make_shared<Batch>();
+    batch->count = count;
+    batch->fn = &fn;
+    
+    // Helpers that start after the batch is drained return right away
+    size_t helpers = std::min(count - 1, m_workers.size());
+    
+    for (size_t i = 0; i < helpers; ++i)
+    {
+        async([batch]() { batch->run(); });
+    }
+    
+    batch->run();
+    
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->finished.wait(lock, [&]() { return batch->done == count; });
+}
+
+void ThreadPool::async(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push(std::move(task));
+    }
+    
+    m_condition.notify_one();
+}
+
+void ThreadPool::work()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+            
+            if (m_stopping && m_queue.empty()) return;
+            
+            task = std::move(m_queue.front());
+            m_queue.pop();
+        }
+        
+        task();
+    }
+}
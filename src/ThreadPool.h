@@ -0,0 +1,43 @@
+//
+//  ThreadPool.h
+//  hlmv
+//
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <queue>
+#include <functional>
+#include <condition_variable>
+
+class ThreadPool
+{
+public:
+    // Shared pool with a worker per hardware thread
+    static ThreadPool& instance();
+    
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+    
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    
+    // Calls fn(i) for every i in [0, count) and returns once all calls finished.
+    // The calling thread takes items too, so nesting from a worker is safe.
+    void parallelFor(size_t count, const std::function<void(size_t)>& fn);
+    
+    size_t size() const { return m_workers.size(); }
+    
+private:
+    void async(std::function<void()> task);
+    void work();
+    
+    std::vector<std::thread> m_workers;
+    std::queue<std::function<void()>> m_queue;
+    
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopping = false;
+};
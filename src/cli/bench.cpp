@@ -0,0 +1,338 @@
+//
+//  bench.cpp
+//  hlmv-cli
+//
+//  Microbenchmarks of the decode kernels. Each one is timed against the
+//  loop it replaced and its output is checked against that loop first.
+//
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <math.h>
+
+#include <chrono>
+#include <functional>
+
+#include "Animation.h"
+#include "Palette.h"
+
+static double now()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Best of `runs`, the least disturbed run is closest to the kernel's cost
+static double bestTime(int runs, const std::function<void()>& fn)
+{
+    double best = 1e30;
+    
+    for (int i = 0; i < runs; ++i)
+    {
+        double start = now();
+        fn();
+        
+        double elapsed = now() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    
+    return best;
+}
+
+// Deterministic noise so every run expands the same texture
+static void fillNoise(std::vector<byte>& data, uint32_t seed)
+{
+    for (auto& value : data)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        value = byte(seed >> 24);
+    }
+}
+
+// The per-byte loop makeTexture used before the kernels
+static void expandLoop(const byte* data, const byte* palette, int count, byte* rgba)
+{
+    const int RGB_SIZE = 3;
+    const int RGBA_SIZE = 4;
+    
+    for (int i = 0; i < count; ++i)
+    {
+        byte item = data[i];
+        
+        int paletteOffset = int(item) * RGB_SIZE;
+        int pixelOffset = i * RGBA_SIZE;
+        
+        rgba[pixelOffset + 0] = palette[paletteOffset + 0];
+        rgba[pixelOffset + 1] = palette[paletteOffset + 1];
+        rgba[pixelOffset + 2] = palette[paletteOffset + 2];
+        rgba[pixelOffset + 3] = 255;
+    }
+}
+
+static int benchPalette()
+{
+    const int SIZE = 1024;
+    const int RUNS = 20;
+    const int COUNT = SIZE * SIZE;
+    
+    std::vector<byte> indices(COUNT);
+    std::vector<byte> palette(256 * 3);
+    fillNoise(indices, 1);
+    fillNoise(palette, 2);
+    
+    std::vector<byte> expected(COUNT * 4);
+    std::vector<byte> rgba(COUNT * 4);
+    
+    double megabytes = rgba.size() / (1024.0 * 1024.0);
+    
+    printf("palette expansion, %ix%i texels, best of %i, MB/s of RGBA written\n", SIZE, SIZE, RUNS);
+    
+    double reference = bestTime(RUNS, [&]() {
+        expandLoop(indices.data(), palette.data(), COUNT, expected.data());
+    });
+    
+    printf("  %-8s %8.1f MB/s\n", "loop", megabytes / reference);
+    
+    int failed = 0;
+    
+    for (PaletteKernel kernel : { PaletteKernel::Scalar, PaletteKernel::AVX2 })
+    {
+        if (!isSupported(kernel))
+        {
+            printf("  %-8s not supported by this CPU\n", kernelName(kernel));
+            continue;
+        }
+        
+        memset(rgba.data(), 0, rgba.size());
+        expandPalette(indices.data(), palette.data(), COUNT, rgba.data(), kernel);
+        
+        if (rgba != expected)
+        {
+            printf("  %-8s output differs from the loop\n", kernelName(kernel));
+            failed++;
+            continue;
+        }
+        
+        double elapsed = bestTime(RUNS, [&]() {
+            expandPalette(indices.data(), palette.data(), COUNT, rgba.data(), kernel);
+        });
+        
+        printf("  %-8s %8.1f MB/s  %5.2fx\n", kernelName(kernel), megabytes / elapsed, reference / elapsed);
+    }
+    
+    return failed == 0 ? 0 : 1;
+}
+
+// The walk decodeSequence did for every frame: from the first span up to
+// the one holding `frame`
+static float decodeFrameRestart(const mstudioanimvalue_t* panimvalue, int frame, float base, float scale)
+{
+    int k = frame;
+    
+    while (panimvalue->num.total <= k)
+    {
+        k -= panimvalue->num.total;
+        panimvalue += panimvalue->num.valid + 1;
+    }
+    
+    if (panimvalue->num.valid > k) {
+        return base + panimvalue[k + 1].value * scale;
+    }
+    
+    return base + panimvalue[panimvalue->num.valid].value * scale;
+}
+
+// Spans like studiomdl writes them: a few distinct values, then the last
+// one held for a while
+static std::vector<mstudioanimvalue_t> encodeNoise(int numframes, uint32_t seed)
+{
+    std::vector<mstudioanimvalue_t> stream;
+    
+    for (int frame = 0; frame < numframes; )
+    {
+        seed = seed * 1664525u + 1013904223u;
+        
+        int valid = 1 + (seed >> 24) % 8;
+        int total = valid + (seed >> 16) % 8;
+        
+        mstudioanimvalue_t header;
+        header.num.valid = valid;
+        header.num.total = total;
+        stream.push_back(header);
+        
+        for (int i = 0; i < valid; ++i)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            
+            mstudioanimvalue_t value;
+            value.value = short(seed >> 16);
+            stream.push_back(value);
+        }
+        
+        frame += total;
+    }
+    
+    return stream;
+}
+
+static int benchAnim()
+{
+    const int CHANNELS = 64 * ANIM_CHANNELS;
+    const int RUNS = 5;
+    const float BASE = 0.5f;
+    const float SCALE = 1.0f / 1024;
+    
+    printf("animation channel decode, %i channels, best of %i, million values/s\n", CHANNELS, RUNS);
+    printf("  %-8s %10s %10s\n", "frames", "restart", "cursor");
+    
+    int failed = 0;
+    
+    for (int numframes : { 30, 100, 300, 1000, 3000 })
+    {
+        std::vector<std::vector<mstudioanimvalue_t>> streams;
+        
+        for (int i = 0; i < CHANNELS; ++i) {
+            streams.push_back(encodeNoise(numframes, i + 1));
+        }
+        
+        std::vector<float> expected((size_t)numframes * CHANNELS);
+        std::vector<float> values((size_t)numframes * CHANNELS);
+        
+        double reference = bestTime(RUNS, [&]() {
+            for (int i = 0; i < CHANNELS; ++i)
+            {
+                for (int frame = 0; frame < numframes; ++frame) {
+                    expected[(size_t)frame * CHANNELS + i] = decodeFrameRestart(streams[i].data(), frame, BASE, SCALE);
+                }
+            }
+        });
+        
+        double elapsed = bestTime(RUNS, [&]() {
+            for (int i = 0; i < CHANNELS; ++i) {
+                decodeAnimChannel(streams[i].data(), numframes, BASE, SCALE, values.data() + i, CHANNELS);
+            }
+        });
+        
+        if (values != expected)
+        {
+            printf("  %-8i cursor output differs from the restarting walk\n", numframes);
+            failed++;
+            continue;
+        }
+        
+        double millions = (double)numframes * CHANNELS / 1e6;
+        
+        printf("  %-8i %10.1f %10.1f  %6.1fx\n", numframes, millions / reference, millions / elapsed, reference / elapsed);
+    }
+    
+    return failed == 0 ? 0 : 1;
+}
+
+// Euler angles as decodeAnimation writes them, mostly within a turn.
+// A few are far outside, some beyond what the polynomial path takes,
+// and a few are not finite, as a damaged file can have them.
+static std::vector<float> fillAngles(size_t count, uint32_t seed)
+{
+    const float NON_FINITE[] = { NAN, INFINITY, -INFINITY, 1e30f };
+    
+    std::vector<float> channels(count * ANIM_CHANNELS);
+    
+    for (size_t i = 0; i < channels.size(); ++i)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        
+        float unit = (seed >> 8) / 16777216.0f - 0.5f;
+        float range = i % 4096 == 0 ? 4 * SINCOS_MAX_ANGLE : 4 * (float)M_PI;
+        
+        channels[i] = unit * range;
+        
+        if (i % 65536 == 3) {
+            channels[i] = NON_FINITE[(i / 65536) % 4];
+        }
+    }
+    
+    return channels;
+}
+
+static int benchQuat()
+{
+    const size_t COUNT = 1 << 20;
+    const int RUNS = 10;
+    
+    std::vector<float> channels = fillAngles(COUNT, 1);
+    std::vector<glm::quat> expected(COUNT);
+    std::vector<glm::quat> rotations(COUNT);
+    
+    printf("euler to quaternion, %zu rotations, best of %i, million rotations/s\n", COUNT, RUNS);
+    
+    double reference = bestTime(RUNS, [&]() {
+        for (size_t i = 0; i < COUNT; ++i)
+        {
+            const float* angles = channels.data() + i * ANIM_CHANNELS + 3;
+            expected[i] = glm::quat(glm::vec3(angles[0], angles[1], angles[2]));
+        }
+    });
+    
+    double elapsed = bestTime(RUNS, [&]() {
+        eulerToQuaternions(channels.data() + 3, ANIM_CHANNELS, COUNT, rotations.data());
+    });
+    
+    float maxError = 0;
+    size_t mismatched = 0;
+    
+    for (size_t i = 0; i < COUNT; ++i)
+    {
+        for (int k = 0; k < 4; ++k)
+        {
+            // Angles that aren't finite have to give NaN where glm does
+            if (isnan(rotations[i][k]) != isnan(expected[i][k])) {
+                mismatched++;
+            }
+            else if (!isnan(expected[i][k])) {
+                maxError = std::max(maxError, fabsf(rotations[i][k] - expected[i][k]));
+            }
+        }
+    }
+    
+    double millions = COUNT / 1e6;
+    
+    printf("  %-8s %8.1f\n", "glm", millions / reference);
+    printf("  %-8s %8.1f  %5.2fx  max error %.2g\n", "batched", millions / elapsed, reference / elapsed, maxError);
+    
+    if (maxError > SINCOS_MAX_ERROR)
+    {
+        printf("  batched error is above the %.2g bound\n", SINCOS_MAX_ERROR);
+        return 1;
+    }
+    
+    if (mismatched > 0)
+    {
+        printf("  batched NaN differs from glm in %zu components\n", mismatched);
+        return 1;
+    }
+    
+    return 0;
+}
+
+int runBench(const std::vector<std::string>& args)
+{
+    std::string name = args.empty() ? "" : args[0];
+    
+    if (name == "palette") {
+        return benchPalette();
+    }
+    
+    if (name == "anim") {
+        return benchAnim();
+    }
+    
+    if (name == "quat") {
+        return benchQuat();
+    }
+    
+    printf("benchmarks: palette, anim, quat\n");
+    return 2;
+}
@@ -0,0 +1,12 @@
+//
+//  bench.h
+//  hlmv-cli
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Runs the microbenchmark named by args[0], returns the exit code
+int runBench(const std::vector<std::string>& args);
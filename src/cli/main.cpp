@@ -0,0 +1,493 @@
+//
+//  main.cpp
+//  hlmv-cli
+//
+//  Headless front end for the studio library: parses models without
+//  creating a window or GL context, so it can run on GPU-less machines.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_map>
+
+#include "bench.h"
+#include "GoldSrcModel.h"
+#include "MeshOptimizer.h"
+#include "ModelIndex.h"
+#include "Pose.h"
+#include "SequenceCache.h"
+#include "TextureCompression.h"
+#include "ThreadPool.h"
+
+struct Options
+{
+    ModelLoadOptions load;
+    std::vector<std::string> files;
+    std::string indexFile = "models.index";
+};
+
+struct Totals
+{
+    int models = 0;
+    int failed = 0;
+    size_t bytes = 0;
+    double seconds = 0;
+};
+
+static void usage()
+{
+    printf("usage: hlmv-cli <command> [options] <files...>\n");
+    printf("\n");
+    printf("commands:\n");
+    printf("  stats       parse models and print per-model statistics\n");
+    printf("  validate    parse models and evaluate every frame of every sequence\n");
+    printf("  index       summarize every model under the given directories into an index,\n");
+    printf("              models unchanged since the last run are not parsed again\n");
+    printf("  cache       load models twice through the --cache directory, fails if\n");
+    printf("              the second load has to decode any sequence\n");
+    printf("  bench NAME  run a decode microbenchmark: palette, anim, quat\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -v          print loader output\n");
+    printf("  --no-mmap   read files into memory instead of mapping them\n");
+    printf("  --eager     decode all sequences while loading\n");
+    printf("  --rle-anim  keep animations run length encoded, poses decode two frames\n");
+    printf("  --parallel  decode textures, meshes and sequences on all cores\n");
+    printf("  --cache DIR read and write decoded models (.mdlc) in DIR\n");
+    printf("  --compress  encode skins to BC1/BC3, kept as .bctx in the cache directory\n");
+    printf("  -o FILE     index file to update (default models.index)\n");
+}
+
+static double now()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void printStats(const std::string& filename, const Model& model, const ModelLoadOptions& options)
+{
+    size_t vertices = 0;
+    size_t sourceVertices = 0;
+    size_t triangles = 0;
+    size_t cacheMisses = 0;
+    size_t sourceCacheMisses = 0;
+    
+    for (auto& mesh : model.meshes)
+    {
+        vertices += mesh.vertexBuffer.size();
+        sourceVertices += mesh.sourceVertexCount;
+        triangles += mesh.indexBuffer.size() / 3;
+        cacheMisses += countCacheMisses(mesh.indexBuffer, mesh.vertexBuffer.size());
+        sourceCacheMisses += mesh.sourceCacheMisses;
+    }
+    
+    size_t frames = 0;
+    
+    for (auto& seq : model.sequences)
+    {
+        frames += seq.numFrames;
+    }
+    
+    // Spans are cheap to read, expanded sequences are not decoded for stats
+    size_t spans = 0;
+    
+    if (options.compressedAnimations)
+    {
+        for (int index = 0; index < (int)model.sequences.size(); ++index)
+        {
+            auto sequence = model.sequenceCache->get(index, true);
+            if (sequence) spans += sequence->animation.size();
+        }
+    }
+    
+    size_t texels = 0;
+    size_t compressed = 0;
+    
+    for (auto& texture : model.textures)
+    {
+        texels += texture.width * texture.height;
+        
+        if (texture.compressed == nullptr) continue;
+        
+        for (auto& level : texture.compressed->levels)
+        {
+            compressed += level.data.size();
+        }
+    }
+    
+    printf("%s\n", filename.c_str());
+    printf("  name:       %s\n", model.name.c_str());
+    printf("  bones:      %zu\n", model.bones.size());
+    printf("  sequences:  %zu (%zu frames)\n", model.sequences.size(), frames);
+    
+    if (options.compressedAnimations) {
+        printf("  animation:  %zu bytes as spans, %zu expanded\n", spans, frames * model.bones.size() * (sizeof(glm::quat) + sizeof(glm::vec3)));
+    }
+    printf("  textures:   %zu (%zu texels)\n", model.textures.size(), texels);
+    printf("  skins:      %zu families\n", model.skinFamilies.size());
+    
+    if (compressed > 0) {
+        printf("  compressed: %zu bytes with mipmaps, %zu as RGBA\n", compressed, texels * 4);
+    }
+    printf("  meshes:     %zu\n", model.meshes.size());
+    printf("  vertices:   %zu (%zu before welding)\n", vertices, sourceVertices);
+    printf("  triangles:  %zu\n", triangles);
+    
+    if (triangles > 0) {
+        printf("  acmr:       %.3f (%.3f before reordering)\n", (double)cacheMisses / triangles, (double)sourceCacheMisses / triangles);
+    }
+}
+
+// Runs the same pose evaluation the viewer does for every frame
+// and reports non-finite transforms
+static bool validatePoses(const std::string& filename, const Model& model)
+{
+    std::vector<glm::mat4> transforms;
+    
+    for (int index = 0; index < (int)model.sequences.size(); ++index)
+    {
+        auto sequence = model.sequenceCache->get(index, true);
+        
+        if (sequence == nullptr)
+        {
+            printf("%s: unable to decode sequence %i\n", filename.c_str(), index);
+            return false;
+        }
+        
+        const Sequence& seq = *sequence;
+        
+        for (int frame = 0; frame < seq.numFrames; ++frame)
+        {
+            calcBoneTransforms(seq, model.bones, (float)frame, transforms);
+            
+            for (auto& transform : transforms)
+            {
+                const float* values = &transform[0][0];
+                
+                for (int i = 0; i < 16; ++i)
+                {
+                    if (!isfinite(values[i]))
+                    {
+                        printf("%s: sequence %s frame %i has invalid bone transforms\n", filename.c_str(), seq.name.c_str(), frame);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    
+    return true;
+}
+
+static int run(const std::string& command, const Options& options)
+{
+    bool validate = command == "validate";
+    
+    Totals totals;
+    double start = now();
+    
+    for (auto& filename : options.files)
+    {
+        totals.models++;
+        
+        Model model;
+        
+        if (!model.loadFromFile(filename, options.load))
+        {
+            totals.failed++;
+            continue;
+        }
+        
+        std::error_code ec;
+        totals.bytes += std::filesystem::file_size(filename, ec);
+        
+        if (validate)
+        {
+            if (!validatePoses(filename, model)) {
+                totals.failed++;
+            }
+        }
+        else
+        {
+            printStats(filename, model, options.load);
+        }
+    }
+    
+    totals.seconds = now() - start;
+    
+    printf("%i models, %i failed, %.3f s, %.1f models/s, %.1f MB/s\n",
+           totals.models, totals.failed, totals.seconds,
+           totals.models / totals.seconds,
+           totals.bytes / (1024.0 * 1024.0) / totals.seconds);
+    
+    return totals.failed == 0 ? 0 : 1;
+}
+
+// The first load writes the cache if it misses, the second one has to find
+// the frames of every sequence in it. Compressed loads decode from the model
+// by design and always fail this.
+static int runCacheCheck(const Options& options)
+{
+    if (options.load.cacheDirectory.empty())
+    {
+        printf("cache needs --cache DIR\n");
+        return 2;
+    }
+    
+    int failed = 0;
+    
+    for (auto& filename : options.files)
+    {
+        Model cold;
+        Model warm;
+        
+        if (!cold.loadFromFile(filename, options.load) || !warm.loadFromFile(filename, options.load))
+        {
+            failed++;
+            continue;
+        }
+        
+        for (int index = 0; index < (int)warm.sequences.size(); ++index)
+        {
+            warm.sequenceCache->get(index, true);
+        }
+        
+        size_t decoded = warm.sequenceCache->decodedCount();
+        printf("%s: warm load decoded %zu of %zu sequences\n", filename.c_str(), decoded, warm.sequences.size());
+        
+        if (decoded > 0) {
+            failed++;
+        }
+    }
+    
+    printf("%zu models, %i failed\n", options.files.size(), failed);
+    
+    return failed == 0 ? 0 : 1;
+}
+
+// modelT.mdl and modelNN.mdl belong to model.mdl next to them. Names alone
+// can't tell, 'm10.mdl' may well be a model of its own, so the header of
+// a file named like one decides.
+static bool isCompanionFile(const std::filesystem::path& path)
+{
+    std::string stem = path.stem().string();
+    size_t length = stem.size();
+    
+    bool textureName = length > 1 && toupper(stem[length - 1]) == 'T';
+    bool groupName = length > 2 && isdigit(stem[length - 1]) && isdigit(stem[length - 2]);
+    
+    if (!textureName && !groupName) return false;
+    
+    FILE* fp = fopen(path.string().c_str(), "rb");
+    if (fp == nullptr) return false;
+    
+    studiohdr_t header = { };
+    size_t count = fread(&header, sizeof(header), 1, fp);
+    fclose(fp);
+    
+    if (groupName && count == 1 && header.id == IDSTUDIOSEQHEADER) return true;
+    
+    // Texture files have a full header but no geometry
+    if (textureName && count == 1 && header.id == IDSTUDIOHEADER && header.numbodyparts == 0)
+    {
+        std::error_code ec;
+        std::string modelname = stem.substr(0, length - 1) + path.extension().string();
+        
+        return std::filesystem::exists(path.parent_path() / modelname, ec);
+    }
+    
+    return false;
+}
+
+static int64_t modificationTime(const std::filesystem::path& path)
+{
+    using namespace std::chrono;
+    
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(path, ec);
+    if (ec) return 0;
+    
+    return duration_cast<nanoseconds>(file_clock::to_sys(time).time_since_epoch()).count();
+}
+
+static void findModels(const std::string& directory, std::vector<ModelSummary>& models)
+{
+    std::error_code ec;
+    auto flags = std::filesystem::directory_options::skip_permission_denied;
+    
+    for (std::filesystem::recursive_directory_iterator it(directory, flags, ec), end; !ec && it != end; it.increment(ec))
+    {
+        const std::filesystem::path& path = it->path();
+        
+        std::string extension = path.extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        
+        if (extension != ".mdl" || !it->is_regular_file(ec) || isCompanionFile(path)) continue;
+        
+        ModelSummary summary;
+        summary.path = path.string();
+        summary.size = it->file_size(ec);
+        summary.mtime = modificationTime(path);
+        
+        // Editing the skins of a model counts as a change of the model
+        std::string texturename = textureFilename(summary.path);
+        
+        if (std::filesystem::exists(texturename, ec)) {
+            summary.mtime = std::max(summary.mtime, modificationTime(texturename));
+        }
+        
+        models.push_back(std::move(summary));
+    }
+    
+    if (ec) {
+        printf("unable to read %s: %s\n", directory.c_str(), ec.message().c_str());
+    }
+}
+
+static int runIndex(const Options& options)
+{
+    double start = now();
+    
+    std::vector<ModelSummary> previous;
+    readModelIndex(options.indexFile, previous);
+    
+    std::unordered_map<std::string, const ModelSummary*> known;
+    
+    for (auto& model : previous)
+    {
+        known[model.path] = &model;
+    }
+    
+    std::vector<ModelSummary> models;
+    
+    for (auto& directory : options.files)
+    {
+        findModels(directory, models);
+    }
+    
+    std::sort(models.begin(), models.end(), [](const ModelSummary& a, const ModelSummary& b) {
+        return a.path < b.path;
+    });
+    
+    // Overlapping directories list the same file twice
+    models.erase(std::unique(models.begin(), models.end(), [](const ModelSummary& a, const ModelSummary& b) {
+        return a.path == b.path;
+    }), models.end());
+    
+    std::vector<size_t> changed;
+    
+    for (size_t i = 0; i < models.size(); ++i)
+    {
+        auto it = known.find(models[i].path);
+        
+        if (it != known.end() && it->second->size == models[i].size && it->second->mtime == models[i].mtime) {
+            models[i] = *it->second;
+        }
+        else {
+            changed.push_back(i);
+        }
+    }
+    
+    std::vector<char> parsed(changed.size());
+    
+    ThreadPool::instance().parallelFor(changed.size(), [&](size_t i) {
+        ModelSummary& summary = models[changed[i]];
+        parsed[i] = summarizeModel(summary.path, summary, options.load.useMmap);
+    });
+    
+    // Broken models stay out of the index and are parsed again next time
+    int failed = 0;
+    
+    for (size_t i = changed.size(); i-- > 0;)
+    {
+        if (parsed[i]) continue;
+        
+        models.erase(models.begin() + changed[i]);
+        failed++;
+    }
+    
+    bool written = writeModelIndex(options.indexFile, models);
+    
+    printf("%zu models, %zu parsed, %zu unchanged, %i failed, %.3f s\n",
+           models.size() + failed, changed.size(), models.size() + failed - changed.size(),
+           failed, now() - start);
+    
+    return failed == 0 && written ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        usage();
+        return 2;
+    }
+    
+    std::string command = argv[1];
+    
+    Options options;
+    options.load.verbose = false;
+    
+    for (int i = 2; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-v") == 0) {
+            options.load.verbose = true;
+        }
+        else if (strcmp(argv[i], "--no-mmap") == 0) {
+            options.load.useMmap = false;
+        }
+        else if (strcmp(argv[i], "--eager") == 0) {
+            options.load.lazySequences = false;
+        }
+        else if (strcmp(argv[i], "--rle-anim") == 0) {
+            options.load.compressedAnimations = true;
+        }
+        else if (strcmp(argv[i], "--parallel") == 0) {
+            options.load.parallel = true;
+        }
+        else if (strcmp(argv[i], "--compress") == 0) {
+            options.load.compressTextures = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.load.cacheDirectory = argv[++i];
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.indexFile = argv[++i];
+        }
+        else if (argv[i][0] == '-')
+        {
+            printf("unknown option %s\n", argv[i]);
+            return 2;
+        }
+        else {
+            options.files.push_back(argv[i]);
+        }
+    }
+    
+    if (command == "stats" || command == "validate") {
+        return run(command, options);
+    }
+    
+    if (command == "index") {
+        return runIndex(options);
+    }
+    
+    if (command == "cache") {
+        return runCacheCheck(options);
+    }
+    
+    if (command == "bench") {
+        return runBench(options.files);
+    }
+    
+    usage();
+    return 2;
+}
@@ -19,6 +19,10 @@
 
 #define MAXSTUDIOBONES 128		// total bones actually used
 
+#define IDSTUDIOHEADER		(('T'<<24)+('S'<<16)+('D'<<8)+'I')	// little-endian "IDST"
+#define IDSTUDIOSEQHEADER	(('Q'<<24)+('S'<<16)+('D'<<8)+'I')	// little-endian "IDSQ"
+#define STUDIO_VERSION		10
+
 typedef unsigned char byte;
 
 typedef float vec3_t[3];    // x,y,z